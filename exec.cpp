@@ -1,11 +1,71 @@
 #ifndef QCVM_LOOP
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
+#include <chrono>
+
 #include "gmqcc.h"
 
+/*
+ * The threaded dispatch loop needs the labels-as-values extension, other
+ * compilers silently fall back to the switch loop for VMXF_THREADED.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#   define QCVM_HAVE_COMPUTED_GOTO 1
+#else
+#   define QCVM_HAVE_COMPUTED_GOTO 0
+#endif
+
+/*
+ * Opcodes only found in the decoded statements, see prog_decode.  They
+ * continue where the instruction set of the progs ends.
+ */
+enum {
+    QCVM_LOAD = VINSTR_END, /* LOAD_F/S/ENT/FLD/FNC with a constant, valid field */
+    QCVM_LOAD_V,            /* LOAD_V with a constant, valid field               */
+    QCVM_ADDRESS,           /* ADDRESS with a constant, valid field              */
+    QCVM_CALL,              /* CALLn of a constant, valid function               */
+    QCVM_INVALID,           /* anything which must not be executed               */
+
+    /* fused pairs, see prog_fuse */
+    QCVM_LOAD_STORE,        /* QCVM_LOAD   + STORE_F/S/ENT/FLD/FNC of the result */
+    QCVM_LOAD_STORE_V,      /* QCVM_LOAD_V + STORE_V of the result               */
+    QCVM_EQ_F_IFNOT,        /* EQ_F + IFNOT on the result                        */
+    QCVM_NE_F_IFNOT,        /* NE_F + IFNOT on the result                        */
+    QCVM_LE_IFNOT,          /* LE   + IFNOT on the result                        */
+    QCVM_GE_IFNOT,          /* GE   + IFNOT on the result                        */
+    QCVM_LT_IFNOT,          /* LT   + IFNOT on the result                        */
+    QCVM_GT_IFNOT,          /* GT   + IFNOT on the result                        */
+    QCVM_ADDRESS_STOREP,    /* QCVM_ADDRESS + STOREP_F/S/ENT/FLD/FNC through it  */
+    QCVM_CALL_STORE,        /* QCVM_CALL + STORE_F/S/ENT/FLD/FNC of OFS_RETURN   */
+    QCVM_CALL_STORE_V,      /* QCVM_CALL + STORE_V of OFS_RETURN                 */
+    QCVM_OPCODE_COUNT
+};
+
+static bool prog_decode(qc_program_t *prog);
+static void prog_fuse(qc_program_t *prog);
+static void prog_index(qc_program_t *prog);
+static void prog_index_free(qc_program_t *prog);
+static void prog_plan_params(qc_program_t *prog);
+static void prog_analyze_locals(qc_program_t *prog);
+static void prog_entdirty_range(qc_program_t *prog, size_t from, size_t count);
+static void prog_snapshot_release(qc_snapshot_t *snap);
+static void prog_grow_entities(qc_program_t *prog);
+
+static bool prog_little_endian(void) {
+#if PLATFORM_BYTE_ORDER == GMQCC_BYTE_ORDER_LITTLE
+    return true;
+#elif PLATFORM_BYTE_ORDER == -1
+    const uint16_t one = 1;
+    return *(const char*)&one == 1;
+#else
+    return false;
+#endif
+}
+
 static void loaderror(const char *fmt, ...)
 {
     int     err = errno;
@@ -28,10 +88,21 @@ static void qcvmerror(qc_program_t *prog, const char *fmt, ...)
     putchar('\n');
 }
 
-qc_program_t* prog_load(const char *filename, bool skipversion)
+/* a zeroed program for prog_load and prog_clone to fill in */
+static qc_program_t *prog_alloc(void)
+{
+    qc_program_t *prog = (qc_program_t*)mem_a(sizeof(qc_program_t));
+    if (prog)
+        memset(prog, 0, sizeof(*prog));
+    return prog;
+}
+
+qc_program_t* prog_load(const char *filename, bool skipversion, size_t lflags)
 {
     prog_header_t header;
     qc_program_t *prog;
+    prog_section_def_t *def;
+    long filesize;
     FILE *file = fopen(filename, "rb");
 
     /* we need all those in order to support INSTR_STATE: */
@@ -58,13 +129,12 @@ qc_program_t* prog_load(const char *filename, bool skipversion)
         return nullptr;
     }
 
-    prog = (qc_program_t*)mem_a(sizeof(qc_program_t));
+    prog = prog_alloc();
     if (!prog) {
         fclose(file);
         fprintf(stderr, "failed to allocate program data\n");
         return nullptr;
     }
-    memset(prog, 0, sizeof(*prog));
 
     prog->entityfields = header.entfield;
     prog->crc16 = header.crc16;
@@ -75,6 +145,27 @@ qc_program_t* prog_load(const char *filename, bool skipversion)
         goto error;
     }
 
+    if ((lflags & VMLF_MMAP) && prog_little_endian())
+        prog->mapping = util_mapfile(filename, &prog->mappingsize);
+
+    /* every section has to be inside the file */
+    if (prog->mapping)
+        filesize = prog->mappingsize;
+    else if (fseek(file, 0, SEEK_END) != 0 || (filesize = ftell(file)) < 0) {
+        loaderror("failed to determine the size of '%s'", filename);
+        goto error;
+    }
+
+#define check_data(hdrvar, progvar)                                    \
+    if (header.hdrvar.offset > (size_t)filesize ||                     \
+        header.hdrvar.length > ((size_t)filesize - header.hdrvar.offset) \
+                             / sizeof(prog->progvar[0]))               \
+    {                                                                  \
+        fprintf(stderr, "the " #hdrvar " section of '%s' is outside of the file\n", \
+                filename);                                             \
+        goto error;                                                    \
+    }
+
 #define read_data(hdrvar, progvar, reserved)                           \
     if (fseek(file, header.hdrvar.offset, SEEK_SET) != 0) {            \
         loaderror("seek failed");                                      \
@@ -91,142 +182,1912 @@ qc_program_t* prog_load(const char *filename, bool skipversion)
         loaderror("read failed");                                      \
         goto error;                                                    \
     }
-#define read_data1(x)    read_data(x, x, 0)
-#define read_data2(x, y) read_data(x, x, y)
 
-    read_data (statements, code, 0);
-    read_data1(defs);
-    read_data1(fields);
-    read_data1(functions);
-    read_data1(strings);
-    read_data2(globals, 2); /* reserve more in case a RETURN using with the global at "the end" exists */
+/* sections at an unaligned offset are still read */
+#define map_data(hdrvar, progvar)                                      \
+    check_data(hdrvar, progvar)                                        \
+    if (prog->mapping && !(header.hdrvar.offset % alignof(decltype(prog->progvar[0])))) { \
+        prog->progvar.map((decltype(&prog->progvar[0]))                \
+                          ((char*)prog->mapping + header.hdrvar.offset), \
+                          header.hdrvar.length);                       \
+    } else {                                                           \
+        read_data(hdrvar, progvar, 0)                                  \
+    }
+
+    map_data  (statements, code);
+    map_data  (defs,       defs);
+    map_data  (fields,     fields);
+    map_data  (functions,  functions);
+    map_data  (strings,    strings);
+    check_data(globals,    globals);
+    read_data (globals,    globals, 2); /* reserve more in case a RETURN using with the global at "the end" exists */
+
+#undef map_data
+#undef read_data
+#undef check_data
 
-    util_swap_statements(prog->code);
-    util_swap_defs_fields(prog->defs);
-    util_swap_defs_fields(prog->fields);
-    util_swap_functions(prog->functions);
+    if (prog->strings.size() && prog->strings[prog->strings.size() - 1]) {
+        fprintf(stderr, "the string table of '%s' is not terminated\n", filename);
+        goto error;
+    }
+
+    /* a mapping is only made on little endian hosts, swapping the copies is enough */
+    util_swap_statements(prog->code.m_copy);
+    util_swap_defs_fields(prog->defs.m_copy);
+    util_swap_defs_fields(prog->fields.m_copy);
+    util_swap_functions(prog->functions.m_copy);
     util_swap_globals(prog->globals);
 
     fclose(file);
+    file = nullptr;
 
     /* profile counters */
     memset(vec_add(prog->profile, prog->code.size()), 0, sizeof(prog->profile[0]) * prog->code.size());
 
-    /* Add tempstring area */
-    prog->tempstring_start = prog->strings.size();
-    prog->tempstring_at = prog->strings.size();
-
-    prog->strings.resize(prog->strings.size() + 16*1024, '\0');
+    /* temp string ring */
+    prog->tempstrings = (char*)mem_a(VM_TEMPSTRING_SIZE);
 
     /* spawn the world entity */
+    prog->entitycolumns  = !!(lflags & VMLF_COLUMNS);
+    prog->entitycapacity = VM_ENTITY_CHUNK;
+    prog->entitystride   = prog->entitycolumns ? 1 : prog->entityfields;
+    prog->fieldstride    = prog->entitycolumns ? prog->entitycapacity : 1;
     vec_push(prog->entitypool, true);
-    memset(vec_add(prog->entitydata, prog->entityfields), 0, prog->entityfields * sizeof(prog->entitydata[0]));
+    vec_push(prog->entityfree, 0);
+    memset(vec_add(prog->entitydata, prog->entityfields * VM_ENTITY_CHUNK), 0,
+           prog->entityfields * VM_ENTITY_CHUNK * sizeof(prog->entitydata[0]));
     prog->entities = 1;
+    prog_entdirty_range(prog, 0, vec_size(prog->entitydata));
+
+    prog_index(prog);
 
     /* cache some globals and fields from names */
-    for (auto &it : prog->defs) {
-        const char *name = prog_getstring(prog, it.name);
-        if (!strcmp(name, "self")) {
-            prog->cached_globals.self = it.offset;
-            has_self = true;
-        }
-        else if (!strcmp(name, "time")) {
-            prog->cached_globals.time = it.offset;
-            has_time = true;
-        }
+    if ((def = prog_find_global(prog, "self"))) {
+        prog->cached_globals.self = def->offset;
+        has_self = true;
     }
-    for (auto &it : prog->fields) {
-        const char *name = prog_getstring(prog, it.name);
-        if (!strcmp(name, "think")) {
-            prog->cached_fields.think = it.offset;
-            has_think = true;
-        }
-        else if (!strcmp(name, "nextthink")) {
-            prog->cached_fields.nextthink = it.offset;
-            has_nextthink = true;
-        }
-        else if (!strcmp(name, "frame")) {
-            prog->cached_fields.frame  = it.offset;
-            has_frame = true;
-        }
+    if ((def = prog_find_global(prog, "time"))) {
+        prog->cached_globals.time = def->offset;
+        has_time = true;
+    }
+    if ((def = prog_find_field(prog, "think"))) {
+        prog->cached_fields.think = def->offset;
+        has_think = true;
+    }
+    if ((def = prog_find_field(prog, "nextthink"))) {
+        prog->cached_fields.nextthink = def->offset;
+        has_nextthink = true;
+    }
+    if ((def = prog_find_field(prog, "frame"))) {
+        prog->cached_fields.frame = def->offset;
+        has_frame = true;
     }
     if (has_self && has_time && has_think && has_nextthink && has_frame)
         prog->supports_state = true;
 
+    if (!prog_decode(prog)) {
+        loaderror("failed to decode program");
+        goto error;
+    }
+    prog_fuse(prog);
+    prog_analyze_locals(prog);
+    prog_plan_params(prog);
+
     return prog;
 
 error:
     if (prog->filename)
         mem_d(prog->filename);
+    if (prog->mapping)
+        util_unmapfile(prog->mapping, prog->mappingsize);
+    if (prog->tempstrings)
+        mem_d(prog->tempstrings);
+    vec_free(prog->decoded);
+    vec_free(prog->callcaches);
+    vec_free(prog->funcinfo);
+    vec_free(prog->profile);
     vec_free(prog->entitydata);
     vec_free(prog->entitypool);
+    vec_free(prog->entityfree);
+    vec_free(prog->entityfreelist);
+    vec_free(prog->entitydirty);
+    prog_index_free(prog);
     mem_d(prog);
 
-    fclose(file);
+    if (file)
+        fclose(file);
     return nullptr;
 }
 
 void prog_delete(qc_program_t *prog)
 {
     if (prog->filename) mem_d(prog->filename);
+    if (prog->mapping) util_unmapfile(prog->mapping, prog->mappingsize);
+    if (prog->tempstrings) mem_d(prog->tempstrings);
+    vec_free(prog->decoded);
+    vec_free(prog->callcaches);
+    vec_free(prog->funcinfo);
     vec_free(prog->entitydata);
     vec_free(prog->entitypool);
+    vec_free(prog->entityfree);
+    vec_free(prog->entityfreelist);
     vec_free(prog->localstack);
     vec_free(prog->stack);
+    vec_free(prog->function_stack);
     vec_free(prog->profile);
+    vec_free(prog->profnodes);
+    vec_free(prog->linenums);
+    vec_free(prog->builtins);
+    vec_free(prog->errortrace);
+    vec_free(prog->entitydirty);
+    prog_trace_end(prog);
+    if (prog->snapbase)
+        prog_snapshot_release(prog->snapbase);
+    prog_index_free(prog);
     mem_d(prog);
 }
 
+/* makes dst's vector a copy of src's, keeping what dst already allocated */
+#define prog_copy_vec(dst, src) do {                                           \
+    if (dst)                                                                   \
+        vec_shrinkto(dst, 0);                                                  \
+    if (vec_size(src))                                                         \
+        memcpy(vec_add(dst, vec_size(src)), src, vec_size(src) * sizeof(*(src))); \
+} while (0)
+
+/*
+ * Copies the state a program changes while running: the globals, the
+ * entities and the temp strings.  Both programs have to be clones of each
+ * other, see prog_clone.
+ */
+void prog_copy_state(qc_program_t *dst, qc_program_t *src) {
+    dst->globals = src->globals;
+
+    prog_copy_vec(dst->entitydata,     src->entitydata);
+    prog_copy_vec(dst->entitypool,     src->entitypool);
+    prog_copy_vec(dst->entityfree,     src->entityfree);
+    prog_copy_vec(dst->entityfreelist, src->entityfreelist);
+    dst->entities        = src->entities;
+    dst->entitycapacity  = src->entitycapacity;
+    dst->entitystride    = src->entitystride;
+    dst->fieldstride     = src->fieldstride;
+    dst->entityfreeword  = src->entityfreeword;
+    dst->entityfreecount = src->entityfreecount;
+    dst->entityfreehead  = src->entityfreehead;
+    prog_entdirty_range(dst, 0, vec_size(dst->entitydata));
+
+    memcpy(dst->tempstrings, src->tempstrings, VM_TEMPSTRING_SIZE);
+    dst->tempdirty = ~(uint64_t)0;
+    dst->tempstring_at      = src->tempstring_at;
+    dst->tempstring_prevend = src->tempstring_prevend;
+    dst->tempstring_gen     = src->tempstring_gen;
+}
+
+/*
+ * Makes a program which shares the code, defs, fields, functions and
+ * strings of prog, so prog has to outlive it, and starts out with a copy
+ * of its state.  Programs and their clones can run on different threads.
+ * Returns nullptr if the clone can't be allocated or decoded.
+ */
+qc_program_t *prog_clone(qc_program_t *prog) {
+    qc_program_t *clone = prog_alloc();
+    if (!clone)
+        return nullptr;
+
+    clone->filename = util_strdup(prog->filename);
+    clone->code.map(&prog->code[0], prog->code.size());
+    clone->defs.map(&prog->defs[0], prog->defs.size());
+    clone->fields.map(&prog->fields[0], prog->fields.size());
+    clone->functions.map(&prog->functions[0], prog->functions.size());
+    clone->strings.map(&prog->strings[0], prog->strings.size());
+    prog_index(clone);
+
+    clone->crc16            = prog->crc16;
+    clone->entityfields     = prog->entityfields;
+    clone->entitycolumns    = prog->entitycolumns;
+    clone->entityreuse      = prog->entityreuse;
+    clone->allowworldwrites = prog->allowworldwrites;
+    clone->cached_fields    = prog->cached_fields;
+    clone->cached_globals   = prog->cached_globals;
+    clone->supports_state   = prog->supports_state;
+    clone->userdata         = prog->userdata;
+    clone->builtins_count   = prog->builtins_count;
+    prog_copy_vec(clone->builtins, prog->builtins);
+    prog_copy_vec(clone->funcinfo, prog->funcinfo);
+    prog_copy_vec(clone->linenums, prog->linenums);
+    memset(vec_add(clone->profile, prog->code.size()), 0, sizeof(clone->profile[0]) * prog->code.size());
+
+    clone->tempstrings = (char*)mem_a(VM_TEMPSTRING_SIZE);
+    prog_copy_state(clone, prog);
+
+    /* the decoded statements point into the globals, so they are the clone's own */
+    if (!prog_decode(clone)) {
+        prog_delete(clone);
+        return nullptr;
+    }
+    prog_fuse(clone);
+    return clone;
+}
+
+/***********************************************************************
+ * Snapshots
+ */
+
+#define SNAPSHOT_BLOCKBYTES (VM_SNAPSHOT_BLOCK * sizeof(qcint_t))
+
+/* the temp string ring is tracked with a bit per block in a 64 bit word */
+#define SNAPSHOT_TEMPBLOCKS (VM_TEMPSTRING_SIZE / SNAPSHOT_BLOCKBYTES)
+typedef int static_assert_is_tempdirty_safe[(SNAPSHOT_TEMPBLOCKS <= 64) ? 1 : -1];
+
+static qc_snapshot_block_t *prog_snapshot_block(const void *data, size_t bytes) {
+    qc_snapshot_block_t *block = (qc_snapshot_block_t*)mem_a(sizeof(qc_snapshot_block_t));
+    block->refs = 1;
+    memcpy(block->data, data, bytes);
+    if (bytes < SNAPSHOT_BLOCKBYTES)
+        memset((char*)block->data + bytes, 0, SNAPSHOT_BLOCKBYTES - bytes);
+    return block;
+}
+
+static qc_snapshot_block_t *prog_snapshot_share(qc_snapshot_block_t *block) {
+    block->refs++;
+    return block;
+}
+
+static void prog_snapshot_release_blocks(qc_snapshot_block_t **blocks) {
+    size_t i;
+    for (i = 0; i < vec_size(blocks); ++i) {
+        if (!--blocks[i]->refs)
+            mem_d(blocks[i]);
+    }
+    vec_free(blocks);
+}
+
+static void prog_snapshot_release(qc_snapshot_t *snap) {
+    if (--snap->refs)
+        return;
+    prog_snapshot_release_blocks(snap->globals);
+    prog_snapshot_release_blocks(snap->entitydata);
+    prog_snapshot_release_blocks(snap->tempstrings);
+    vec_free(snap->entitypool);
+    vec_free(snap->entityfree);
+    vec_free(snap->entityfreelist);
+    mem_d(snap);
+}
+
+/* the values of block b of something count values long */
+static GMQCC_INLINE size_t prog_snapshot_blocksize(size_t count, size_t b) {
+    size_t left = count - b * VM_SNAPSHOT_BLOCK;
+    return left < VM_SNAPSHOT_BLOCK ? left : VM_SNAPSHOT_BLOCK;
+}
+
+#define ENTITY_DIRTY(prog, b) ((prog)->entitydirty[(b) >> 5] & (1u << ((b) & 31)))
+#define TEMP_DIRTY(prog, b)   ((prog)->tempdirty & ((uint64_t)1 << (b)))
+
+static void prog_snapshot_clean(qc_program_t *prog, qc_snapshot_t *snap) {
+    if (prog->snapbase)
+        prog_snapshot_release(prog->snapbase);
+    prog->snapbase = snap;
+    snap->refs++;
+    if (vec_size(prog->entitydirty))
+        memset(prog->entitydirty, 0, vec_size(prog->entitydirty) * sizeof(prog->entitydirty[0]));
+    prog->tempdirty = 0;
+}
+
+/*
+ * Takes a snapshot of the state a program changes while running, to be
+ * put back with prog_restore.  Blocks which didn't change since the last
+ * snapshot or restore are shared with that one instead of copied, so
+ * taking one every frame costs about what the frame changed.
+ */
+qc_snapshot_t *prog_snapshot(qc_program_t *prog) {
+    qc_snapshot_t *base = prog->snapbase;
+    qc_snapshot_t *snap = (qc_snapshot_t*)mem_a(sizeof(qc_snapshot_t));
+    size_t         count;
+    size_t         size;
+    size_t         b;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->refs = 1;
+
+    /* the globals are written all the time, so they are compared instead */
+    count = prog->globals.size();
+    snap->globalcount = count;
+    for (b = 0; b * VM_SNAPSHOT_BLOCK < count; ++b) {
+        const qcint_t *data = &prog->globals[b * VM_SNAPSHOT_BLOCK];
+        size = prog_snapshot_blocksize(count, b) * sizeof(qcint_t);
+        if (base && base->globalcount == count && !memcmp(base->globals[b]->data, data, size))
+            vec_push(snap->globals, prog_snapshot_share(base->globals[b]));
+        else
+            vec_push(snap->globals, prog_snapshot_block(data, size));
+    }
+
+    count = vec_size(prog->entitydata);
+    snap->entityfields  = prog->entityfields;
+    snap->entitycolumns = prog->entitycolumns;
+    snap->entitycount   = count;
+    for (b = 0; b * VM_SNAPSHOT_BLOCK < count; ++b) {
+        if (base && b < vec_size(base->entitydata) && !ENTITY_DIRTY(prog, b))
+            vec_push(snap->entitydata, prog_snapshot_share(base->entitydata[b]));
+        else
+            vec_push(snap->entitydata, prog_snapshot_block(prog->entitydata + b * VM_SNAPSHOT_BLOCK,
+                                                           prog_snapshot_blocksize(count, b) * sizeof(qcint_t)));
+    }
+
+    for (b = 0; b < SNAPSHOT_TEMPBLOCKS; ++b) {
+        if (base && !TEMP_DIRTY(prog, b))
+            vec_push(snap->tempstrings, prog_snapshot_share(base->tempstrings[b]));
+        else
+            vec_push(snap->tempstrings, prog_snapshot_block(prog->tempstrings + b * SNAPSHOT_BLOCKBYTES,
+                                                            SNAPSHOT_BLOCKBYTES));
+    }
+
+    prog_copy_vec(snap->entitypool,     prog->entitypool);
+    prog_copy_vec(snap->entityfree,     prog->entityfree);
+    prog_copy_vec(snap->entityfreelist, prog->entityfreelist);
+    snap->entities           = prog->entities;
+    snap->entitycapacity     = prog->entitycapacity;
+    snap->entitystride       = prog->entitystride;
+    snap->fieldstride        = prog->fieldstride;
+    snap->entityfreeword     = prog->entityfreeword;
+    snap->entityfreecount    = prog->entityfreecount;
+    snap->entityfreehead     = prog->entityfreehead;
+    snap->tempstring_at      = prog->tempstring_at;
+    snap->tempstring_prevend = prog->tempstring_prevend;
+    snap->tempstring_gen     = prog->tempstring_gen;
+
+    prog_snapshot_clean(prog, snap);
+    return snap;
+}
+
+/*
+ * Puts the state of a snapshot back.  It has to come from this program
+ * or a clone of it, see prog_clone.  Only the blocks which differ from
+ * the snapshot are copied.
+ */
+bool prog_restore(qc_program_t *prog, qc_snapshot_t *snap) {
+    qc_snapshot_t *base = prog->snapbase;
+    size_t         count;
+    size_t         have;
+    size_t         b;
+
+    if (snap->globalcount != prog->globals.size() ||
+        snap->entityfields != prog->entityfields ||
+        snap->entitycolumns != prog->entitycolumns)
+    {
+        qcvmerror(prog, "`%s` cannot restore a snapshot of a different program", prog->filename);
+        return false;
+    }
+
+    count = snap->globalcount;
+    for (b = 0; b * VM_SNAPSHOT_BLOCK < count; ++b) {
+        memcpy(&prog->globals[b * VM_SNAPSHOT_BLOCK], snap->globals[b]->data,
+               prog_snapshot_blocksize(count, b) * sizeof(qcint_t));
+    }
+
+    /* resizing keeps the values in place, what is added is dirty */
+    count = snap->entitycount;
+    have  = vec_size(prog->entitydata);
+    if (have > count)
+        vec_shrinkto(prog->entitydata, count);
+    else if (have < count) {
+        vec_add(prog->entitydata, count - have);
+        prog_entdirty_range(prog, have, count - have);
+    }
+    for (b = 0; b * VM_SNAPSHOT_BLOCK < count; ++b) {
+        if (base && b < vec_size(base->entitydata) && base->entitydata[b] == snap->entitydata[b] &&
+            !ENTITY_DIRTY(prog, b))
+            continue;
+        memcpy(prog->entitydata + b * VM_SNAPSHOT_BLOCK, snap->entitydata[b]->data,
+               prog_snapshot_blocksize(count, b) * sizeof(qcint_t));
+    }
+
+    for (b = 0; b < SNAPSHOT_TEMPBLOCKS; ++b) {
+        if (base && base->tempstrings[b] == snap->tempstrings[b] && !TEMP_DIRTY(prog, b))
+            continue;
+        memcpy(prog->tempstrings + b * SNAPSHOT_BLOCKBYTES, snap->tempstrings[b]->data, SNAPSHOT_BLOCKBYTES);
+    }
+
+    prog_copy_vec(prog->entitypool,     snap->entitypool);
+    prog_copy_vec(prog->entityfree,     snap->entityfree);
+    prog_copy_vec(prog->entityfreelist, snap->entityfreelist);
+    prog->entities           = snap->entities;
+    prog->entitycapacity     = snap->entitycapacity;
+    prog->entitystride       = snap->entitystride;
+    prog->fieldstride        = snap->fieldstride;
+    prog->entityfreeword     = snap->entityfreeword;
+    prog->entityfreecount    = snap->entityfreecount;
+    prog->entityfreehead     = snap->entityfreehead;
+    prog->tempstring_at      = snap->tempstring_at;
+    prog->tempstring_prevend = snap->tempstring_prevend;
+    prog->tempstring_gen     = snap->tempstring_gen;
+
+    prog_snapshot_clean(prog, snap);
+    return true;
+}
+
+/* drops the host's snapshot, programs using it as their base keep it */
+void prog_snapshot_delete(qc_snapshot_t *snap) {
+    prog_snapshot_release(snap);
+}
+
+#undef ENTITY_DIRTY
+#undef TEMP_DIRTY
+#undef SNAPSHOT_TEMPBLOCKS
+#undef SNAPSHOT_BLOCKBYTES
+
+/***********************************************************************
+ * Reloading
+ */
+
+/* what a value of a global or field needs to mean the same in the new program */
+enum {
+    QCVM_RELOAD_COPY,
+    QCVM_RELOAD_STRING,
+    QCVM_RELOAD_FUNCTION,
+    QCVM_RELOAD_FIELD,
+    QCVM_RELOAD_POINTER
+};
+
+struct prog_remap_t {
+    qc_program_t *from;
+    qc_program_t *to;
+    qcint_t      *functions;  /* old function number to new, 0 when it is gone */
+    qcint_t      *fields;     /* old field offset to new, -1 when it is gone    */
+    hash_table_t *strings;    /* the new program's strings, offset + 1          */
+};
+
+static int prog_reload_kind(uint16_t type) {
+    switch (type & DEF_TYPEMASK) {
+        case TYPE_STRING:   return QCVM_RELOAD_STRING;
+        case TYPE_FUNCTION: return QCVM_RELOAD_FUNCTION;
+        case TYPE_FIELD:    return QCVM_RELOAD_FIELD;
+        case TYPE_POINTER:  return QCVM_RELOAD_POINTER;
+        default:            return QCVM_RELOAD_COPY;
+    }
+}
+
+/* a string which isn't in the new program is added to its string section */
+static qcint_t prog_reload_string(prog_remap_t *r, qcint_t str) {
+    const char *s;
+    size_t      len;
+    size_t      at;
+    uintptr_t   found;
+
+    /* temp strings are kept, the ring moves over as it is */
+    if (str <= 0 || (size_t)str >= r->from->strings.size())
+        return str;
+    s = prog_getstring(r->from, str);
+    if ((found = (uintptr_t)util_htget(r->strings, s)))
+        return (qcint_t)(found - 1);
+
+    if (r->to->strings.m_copy.empty()) {
+        std::vector<char> copy(r->to->strings.begin(), r->to->strings.end());
+        r->to->strings.m_copy.swap(copy);
+    }
+    len = strlen(s) + 1;
+    at  = r->to->strings.size();
+    r->to->strings.m_copy.insert(r->to->strings.m_copy.end(), s, s + len);
+    r->to->strings.m_data = r->to->strings.m_copy.data();
+    r->to->strings.m_size = r->to->strings.m_copy.size();
+    util_htset(r->strings, s, (void*)(uintptr_t)(at + 1));
+    return (qcint_t)at;
+}
+
+static qcint_t prog_reload_value(prog_remap_t *r, int kind, qcint_t value) {
+    size_t fields = r->from->entityfields;
+
+    switch (kind) {
+        case QCVM_RELOAD_STRING:
+            return prog_reload_string(r, value);
+        case QCVM_RELOAD_FUNCTION:
+            if (value <= 0 || (size_t)value >= r->from->functions.size())
+                return 0;
+            return r->functions[value];
+        case QCVM_RELOAD_FIELD:
+            if (value < 0 || (size_t)value >= fields || r->fields[value] < 0)
+                return 0;
+            return r->fields[value];
+        case QCVM_RELOAD_POINTER:
+            /* an ADDRESS into the entity data, entity * entityfields + field */
+            if (value < 0 || (size_t)value >= fields * r->from->entities ||
+                r->fields[value % fields] < 0)
+                return 0;
+            return (qcint_t)((value / fields) * r->to->entityfields) + r->fields[value % fields];
+        default:
+            return value;
+    }
+}
+
+/*
+ * Loads filename as the new version of prog and moves prog's state over:
+ * the saved globals and the entity fields whose name and type are still
+ * there, the entities and the temp strings.  Function, field and string
+ * values are translated to the new program by name, one that is gone
+ * becomes 0.  The builtins and host settings are taken over too.  prog
+ * is left as it was, the host deletes it once it switched to the new one.
+ */
+qc_program_t *prog_reload(qc_program_t *prog, const char *filename, size_t lflags) {
+    qc_program_t *np = prog_load(filename, false, lflags);
+    prog_remap_t   r;
+    uint32_t     *from;   /* for each new field slot, the old one + 1 */
+    uint8_t      *kinds;
+    size_t        i;
+    size_t        k;
+    qcint_t       e;
+
+    if (!np)
+        return nullptr;
+
+    np->builtins_count   = prog->builtins_count;
+    np->entityreuse      = prog->entityreuse;
+    np->allowworldwrites = prog->allowworldwrites;
+    np->userdata         = prog->userdata;
+    prog_copy_vec(np->builtins, prog->builtins);
+
+    r.from      = prog;
+    r.to        = np;
+    r.functions = nullptr;
+    r.fields    = nullptr;
+    r.strings   = util_htnew(1024);
+
+    for (i = 0; i < prog->functions.size(); ++i) {
+        prog_section_function_t *fn = i ? prog_find_function(np, prog_getstring(prog, prog->functions[i].name)) : nullptr;
+        vec_push(r.functions, fn ? (qcint_t)(fn - &np->functions[0]) : 0);
+    }
+    for (i = 0; i < np->strings.size(); i += strlen(&np->strings[i]) + 1) {
+        if (!util_htget(r.strings, &np->strings[i]))
+            util_htset(r.strings, &np->strings[i], (void*)(uintptr_t)(i + 1));
+    }
+
+    /* which old field each new one is filled from */
+    from  = (uint32_t*)mem_a(sizeof(uint32_t) * (np->entityfields + 1));
+    kinds = (uint8_t*)mem_a(np->entityfields + 1);
+    memset(from, 0, sizeof(uint32_t) * (np->entityfields + 1));
+    memset(vec_add(r.fields, prog->entityfields), 0xff, sizeof(qcint_t) * prog->entityfields);
+    for (auto &it : np->fields) {
+        prog_section_def_t *old = prog_find_field(prog, prog_getstring(np, it.name));
+        size_t size = (it.type == TYPE_VECTOR) ? 3 : 1;
+        if (!it.name || !old || old->type != it.type)
+            continue;
+        if (old->offset + size > prog->entityfields || it.offset + size > np->entityfields)
+            continue;
+        for (k = 0; k < size; ++k) {
+            from[it.offset + k]         = old->offset + k + 1;
+            kinds[it.offset + k]        = size == 3 ? QCVM_RELOAD_COPY : prog_reload_kind(it.type);
+            r.fields[old->offset + k]   = it.offset + k;
+        }
+    }
+
+    /* the entities, in one pass over them */
+    while (np->entitycapacity < (size_t)prog->entities)
+        prog_grow_entities(np);
+    prog_copy_vec(np->entitypool,     prog->entitypool);
+    prog_copy_vec(np->entityfree,     prog->entityfree);
+    prog_copy_vec(np->entityfreelist, prog->entityfreelist);
+    np->entities        = prog->entities;
+    np->entityfreeword  = prog->entityfreeword;
+    np->entityfreecount = prog->entityfreecount;
+    np->entityfreehead  = prog->entityfreehead;
+    for (e = 0; e < prog->entities; ++e) {
+        const qcint_t *src = prog->entitydata + e * prog->entitystride;
+        qcint_t       *dst = np->entitydata + e * np->entitystride;
+        for (i = 0; i < np->entityfields; ++i) {
+            if (from[i])
+                dst[i * np->fieldstride] = prog_reload_value(&r, kinds[i], src[(from[i] - 1) * prog->fieldstride]);
+        }
+    }
+    prog_entdirty_range(np, 0, vec_size(np->entitydata));
+
+    /* the globals the program changes, as a savegame would have them */
+    for (auto &it : prog->defs) {
+        prog_section_def_t *nd;
+        size_t size;
+        if (!(it.type & DEF_SAVEGLOBAL) || !it.name)
+            continue;
+        nd = prog_find_global(np, prog_getstring(prog, it.name));
+        if (!nd || nd->type != it.type)
+            continue;
+        size = ((it.type & DEF_TYPEMASK) == TYPE_VECTOR) ? 3 : 1;
+        if (it.offset + size > prog->globals.size() || nd->offset + size > np->globals.size())
+            continue;
+        for (k = 0; k < size; ++k)
+            np->globals[nd->offset + k] = prog_reload_value(&r, prog_reload_kind(it.type), prog->globals[it.offset + k]);
+    }
+
+    memcpy(np->tempstrings, prog->tempstrings, VM_TEMPSTRING_SIZE);
+    np->tempstring_at      = prog->tempstring_at;
+    np->tempstring_prevend = prog->tempstring_prevend;
+    np->tempstring_gen     = prog->tempstring_gen;
+    np->tempdirty          = ~(uint64_t)0;
+
+    mem_d(from);
+    mem_d(kinds);
+    vec_free(r.functions);
+    vec_free(r.fields);
+    util_htdel(r.strings);
+
+    /* decoding trusted the values of the globals the program never writes,
+     * some of which were just replaced, so it is done again */
+    vec_free(np->decoded);
+    vec_free(np->callcaches);
+    vec_free(np->funcinfo);
+    if (!prog_decode(np)) {
+        prog_delete(np);
+        return nullptr;
+    }
+    prog_fuse(np);
+    prog_analyze_locals(np);
+    prog_plan_params(np);
+    return np;
+}
+
+#undef prog_copy_vec
+
+/***********************************************************************
+ * Statement decoding
+ */
+
+/* which operands an instruction reads or writes */
+#define OPERAND_A 1
+#define OPERAND_B 2
+#define OPERAND_C 4
+
+static int prog_decode_operands(uint16_t opcode) {
+    switch (opcode) {
+        case INSTR_GOTO:
+            return 0;
+        case INSTR_DONE:
+        case INSTR_RETURN:
+        case INSTR_IF:
+        case INSTR_IFNOT:
+        case INSTR_CALL0:
+        case INSTR_CALL1:
+        case INSTR_CALL2:
+        case INSTR_CALL3:
+        case INSTR_CALL4:
+        case INSTR_CALL5:
+        case INSTR_CALL6:
+        case INSTR_CALL7:
+        case INSTR_CALL8:
+            return OPERAND_A;
+        case INSTR_STORE_F:
+        case INSTR_STORE_V:
+        case INSTR_STORE_S:
+        case INSTR_STORE_ENT:
+        case INSTR_STORE_FLD:
+        case INSTR_STORE_FNC:
+        case INSTR_STOREP_F:
+        case INSTR_STOREP_V:
+        case INSTR_STOREP_S:
+        case INSTR_STOREP_ENT:
+        case INSTR_STOREP_FLD:
+        case INSTR_STOREP_FNC:
+        case INSTR_STATE:
+            return OPERAND_A | OPERAND_B;
+        case INSTR_NOT_F:
+        case INSTR_NOT_V:
+        case INSTR_NOT_S:
+        case INSTR_NOT_ENT:
+        case INSTR_NOT_FNC:
+            return OPERAND_A | OPERAND_C;
+        default:
+            return OPERAND_A | OPERAND_B | OPERAND_C;
+    }
+}
+
+/*
+ * The global an instruction writes into, or 0 if it doesn't write into
+ * one of the operand globals.
+ */
+static qcint_t prog_decode_output(const prog_section_statement_t *st) {
+    switch (st->opcode) {
+        case INSTR_STORE_F:
+        case INSTR_STORE_V:
+        case INSTR_STORE_S:
+        case INSTR_STORE_ENT:
+        case INSTR_STORE_FLD:
+        case INSTR_STORE_FNC:
+            return st->o2.u1;
+        default:
+            if (prog_decode_operands(st->opcode) & OPERAND_C)
+                return st->o3.u1;
+            return 0;
+    }
+}
+
+static bool prog_decode_call(uint16_t opcode) {
+    return (opcode >= INSTR_CALL0 && opcode <= INSTR_CALL8) || opcode == QCVM_CALL;
+}
+
+/*
+ * Builds prog->decoded from prog->code.  A field or function operand is
+ * only trusted when the global belongs to a def of that type and it is
+ * never written by the program: it is none of the return, parameter or
+ * local slots and no statement stores into it.  Hosts must not change
+ * such globals after loading either.
+ */
+static bool prog_decode(qc_program_t *prog) {
+    size_t    count    = prog->code.size();
+    size_t    nglobals = prog->globals.size();
+    uint16_t *deftype  = nullptr;
+    bool     *written  = nullptr;
+    size_t    calls;
+    size_t    i;
+
+    if (!(deftype = (uint16_t*)mem_a(sizeof(*deftype) * nglobals)) ||
+        !(written = (bool*)mem_a(sizeof(*written) * nglobals)))
+    {
+        mem_d(deftype);
+        return false;
+    }
+    memset(deftype, 0, sizeof(*deftype) * nglobals);
+    memset(written, 0, sizeof(*written) * nglobals);
+
+    for (auto &it : prog->defs) {
+        if (it.offset < nglobals && !deftype[it.offset])
+            deftype[it.offset] = it.type & DEF_TYPEMASK;
+    }
+
+    for (i = 0; i < nglobals && i < OFS_PARM7 + 3; ++i)
+        written[i] = true;
+    for (auto &it : prog->functions) {
+        for (i = it.firstlocal; i < nglobals && i < (size_t)it.firstlocal + it.locals; ++i)
+            written[i] = true;
+    }
+    for (auto &it : prog->code) {
+        qcint_t out = prog_decode_output(&it);
+        /* mark all 3 components, the output might be a vector */
+        for (i = out; out && i < nglobals && i < (size_t)out + 3; ++i)
+            written[i] = true;
+    }
+
+    vec_add(prog->decoded, count);
+    for (i = 0; i < count; ++i) {
+        prog_section_statement_t *st  = &prog->code[i];
+        qc_exec_statement_t      *out = &prog->decoded[i];
+        int                       ops = prog_decode_operands(st->opcode);
+        qcint_t                   value;
+
+        out->opcode = st->opcode;
+        out->imm    = 0;
+        out->a      = (qcany_t*)(&prog->globals[0] + st->o1.u1);
+        out->b      = (qcany_t*)(&prog->globals[0] + st->o2.u1);
+        out->c      = (qcany_t*)(&prog->globals[0] + st->o3.u1);
+
+        if (st->opcode >= VINSTR_END                                ||
+            ((ops & OPERAND_A) && st->o1.u1 >= nglobals)            ||
+            ((ops & OPERAND_B) && st->o2.u1 >= nglobals)            ||
+            ((ops & OPERAND_C) && st->o3.u1 >= nglobals))
+        {
+            out->opcode = QCVM_INVALID;
+            continue;
+        }
+
+        switch (st->opcode) {
+            case INSTR_IF:
+            case INSTR_IFNOT:
+                out->imm = st->o2.s1;
+                break;
+            case INSTR_GOTO:
+                out->imm = st->o1.s1;
+                break;
+
+            case INSTR_LOAD_F:
+            case INSTR_LOAD_S:
+            case INSTR_LOAD_ENT:
+            case INSTR_LOAD_FLD:
+            case INSTR_LOAD_FNC:
+            case INSTR_LOAD_V:
+            case INSTR_ADDRESS:
+                if (deftype[st->o2.u1] != TYPE_FIELD || written[st->o2.u1])
+                    break;
+                value = out->b->_int;
+                if (value < 0 || value + (st->opcode == INSTR_LOAD_V ? 3 : 1) > (qcint_t)prog->entityfields)
+                    break;
+                out->opcode = (st->opcode == INSTR_LOAD_V)  ? QCVM_LOAD_V
+                            : (st->opcode == INSTR_ADDRESS) ? QCVM_ADDRESS
+                            :                                 QCVM_LOAD;
+                break;
+
+            case INSTR_CALL0:
+            case INSTR_CALL1:
+            case INSTR_CALL2:
+            case INSTR_CALL3:
+            case INSTR_CALL4:
+            case INSTR_CALL5:
+            case INSTR_CALL6:
+            case INSTR_CALL7:
+            case INSTR_CALL8:
+                out->imm = st->opcode - INSTR_CALL0;
+                if (deftype[st->o1.u1] != TYPE_FUNCTION || written[st->o1.u1])
+                    break;
+                value = out->a->function;
+                if (value > 0 && value < (qcint_t)prog->functions.size())
+                    out->opcode = QCVM_CALL;
+                break;
+        }
+
+        /* jumps must land inside the program */
+        if (out->imm && (st->opcode == INSTR_IF || st->opcode == INSTR_IFNOT || st->opcode == INSTR_GOTO)) {
+            if ((qcint_t)i + out->imm < 0 || (size_t)((qcint_t)i + out->imm) >= count)
+                out->opcode = QCVM_INVALID;
+        }
+        out->fused = out->opcode;
+    }
+
+    /* every call gets a cache, allocated at once so they don't move */
+    for (i = 0, calls = 0; i < count; ++i)
+        if (prog_decode_call(prog->decoded[i].opcode))
+            ++calls;
+    if (calls)
+        memset(vec_add(prog->callcaches, calls), 0, calls * sizeof(prog->callcaches[0]));
+    for (i = 0, calls = 0; i < count; ++i)
+        if (prog_decode_call(prog->decoded[i].opcode))
+            prog->decoded[i].call = &prog->callcaches[calls++];
+
+    mem_d(deftype);
+    mem_d(written);
+    return true;
+}
+
+#undef OPERAND_A
+#undef OPERAND_B
+#undef OPERAND_C
+
+static bool prog_fuse_store(uint16_t opcode) {
+    switch (opcode) {
+        case INSTR_STORE_F:
+        case INSTR_STORE_S:
+        case INSTR_STORE_ENT:
+        case INSTR_STORE_FLD:
+        case INSTR_STORE_FNC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool prog_fuse_storep(uint16_t opcode) {
+    switch (opcode) {
+        case INSTR_STOREP_F:
+        case INSTR_STOREP_S:
+        case INSTR_STOREP_ENT:
+        case INSTR_STOREP_FLD:
+        case INSTR_STOREP_FNC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Finds pairs of decoded statements where the second one consumes what the
+ * first one produced and gives the first one a fused opcode.  Only the
+ * unchecked opcodes from prog_decode are considered, so the fused
+ * handlers get away with the checks those need.
+ */
+static void prog_fuse(qc_program_t *prog) {
+    size_t   count  = prog->code.size();
+    qcany_t *ret    = (qcany_t*)(&prog->globals[0] + OFS_RETURN);
+    size_t   i;
+
+    for (i = 0; i + 1 < count; ++i) {
+        qc_exec_statement_t *st   = &prog->decoded[i];
+        qc_exec_statement_t *next = &prog->decoded[i+1];
+
+        switch (st->opcode) {
+            case QCVM_LOAD:
+                if (prog_fuse_store(next->opcode) && next->a == st->c)
+                    st->fused = QCVM_LOAD_STORE;
+                break;
+            case QCVM_LOAD_V:
+                if (next->opcode == INSTR_STORE_V && next->a == st->c)
+                    st->fused = QCVM_LOAD_STORE_V;
+                break;
+
+            case INSTR_EQ_F:
+            case INSTR_NE_F:
+            case INSTR_LE:
+            case INSTR_GE:
+            case INSTR_LT:
+            case INSTR_GT:
+                if (next->opcode != INSTR_IFNOT || next->a != st->c)
+                    break;
+                st->fused = (st->opcode == INSTR_EQ_F) ? QCVM_EQ_F_IFNOT
+                          : (st->opcode == INSTR_NE_F) ? QCVM_NE_F_IFNOT
+                          : (st->opcode == INSTR_LE)   ? QCVM_LE_IFNOT
+                          : (st->opcode == INSTR_GE)   ? QCVM_GE_IFNOT
+                          : (st->opcode == INSTR_LT)   ? QCVM_LT_IFNOT
+                          :                              QCVM_GT_IFNOT;
+                break;
+
+            case QCVM_ADDRESS:
+                if (prog_fuse_storep(next->opcode) && next->b == st->c)
+                    st->fused = QCVM_ADDRESS_STOREP;
+                break;
+
+            case QCVM_CALL:
+                if (next->a != ret)
+                    break;
+                if (prog_fuse_store(next->opcode))
+                    st->fused = QCVM_CALL_STORE;
+                else if (next->opcode == INSTR_STORE_V)
+                    st->fused = QCVM_CALL_STORE_V;
+                break;
+        }
+    }
+}
+
+/***********************************************************************
+ * Parameter copy plans
+ */
+
+/* how prog_enterfunction copies the parameters of a function */
+enum {
+    QCVM_PARAMS_NONE,
+    QCVM_PARAMS_S1,   /* one parameter of one global */
+    QCVM_PARAMS_S2,   /* two of them                 */
+    QCVM_PARAMS_S3,   /* three of them               */
+    QCVM_PARAMS_V1,   /* one vector                  */
+    QCVM_PARAMS_RUNS  /* anything else, see paramrun  */
+};
+
+/*
+ * Fills the parameter plans in prog->funcinfo.  Parameter p is in the 3
+ * globals from OFS_PARM0 + 3*p and its argsize[p] globals are copied into
+ * the locals one after another, so a parameter continues the run of the
+ * previous one when that is a vector.
+ */
+static void prog_plan_params(qc_program_t *prog) {
+    size_t i;
+
+    for (i = 0; i < prog->functions.size(); ++i) {
+        const prog_section_function_t *func  = &prog->functions[i];
+        qc_exec_function_t            *info  = &prog->funcinfo[i];
+        int32_t                        nargs = func->nargs;
+        int32_t                        p;
+        size_t                         scalars = 0;
+
+        if (nargs < 0) nargs = 0;
+        if (nargs > 8) nargs = 8;
+
+        info->paramruns = 0;
+        for (p = 0; p < nargs; ++p) {
+            if (!func->argsize[p])
+                continue;
+            if (func->argsize[p] == 1)
+                scalars++;
+            if (info->paramruns && p && func->argsize[p-1] == 3 &&
+                info->paramrun[info->paramruns-1].from + info->paramrun[info->paramruns-1].count == 3*p)
+            {
+                info->paramrun[info->paramruns-1].count += func->argsize[p];
+                continue;
+            }
+            info->paramrun[info->paramruns].from  = 3*p;
+            info->paramrun[info->paramruns].count = func->argsize[p];
+            info->paramruns++;
+        }
+
+        if (!info->paramruns)
+            info->params = QCVM_PARAMS_NONE;
+        else if (nargs == 1 && func->argsize[0] == 3)
+            info->params = QCVM_PARAMS_V1;
+        else if (nargs <= 3 && scalars == (size_t)nargs)
+            info->params = QCVM_PARAMS_S1 + nargs - 1;
+        else
+            info->params = QCVM_PARAMS_RUNS;
+    }
+}
+
+/***********************************************************************
+ * Call graph analysis for VMXF_LAZYLOCALS
+ */
+
+/* ancestors visited per function before giving up and saving everything */
+#define LAZYLOCALS_VISIT_LIMIT 4096
+
+struct prog_range_t {
+    qcint_t  first;
+    qcint_t  count;
+    size_t   function;
+};
+
+static int prog_range_cmp(const void *a, const void *b) {
+    const prog_range_t *x = (const prog_range_t*)a;
+    const prog_range_t *y = (const prog_range_t*)b;
+    if (x->first != y->first)
+        return (x->first < y->first) ? -1 : 1;
+    return (x->function < y->function) ? -1 : (x->function > y->function);
+}
+
+/*
+ * Fills prog->funcinfo.  On a call the callee's locals only need to be
+ * backed up where they overlap the locals of a function which can still
+ * be further down the stack, and that is any function which can reach the
+ * callee through calls: the callee itself when it is recursive, or the
+ * functions sharing its locals (-Ooverlap-locals).  Calls through a
+ * function variable are taken to reach every function.  Builtins calling
+ * back into the program are not seen here, prog_exec does full backups
+ * when it is re-entered.
+ */
+static void prog_analyze_locals(qc_program_t *prog) {
+    size_t        nfuncs   = prog->functions.size();
+    size_t        any      = nfuncs; /* node for calls through a function variable */
+    prog_range_t *ranges   = nullptr;
+    bool          indirect = false;
+    size_t        i, k;
+
+    std::vector<std::vector<size_t>> callees(nfuncs + 1);
+    std::vector<std::vector<size_t>> callers(nfuncs + 1);
+    std::vector<bool>                shared(nfuncs, false);
+    std::vector<bool>                cyclic(nfuncs, false);
+
+    memset(vec_add(prog->funcinfo, nfuncs), 0, sizeof(*prog->funcinfo) * nfuncs);
+
+    /* QC functions by entry, each one owns the statements up to the next */
+    for (i = 0; i < nfuncs; ++i) {
+        if (prog->functions[i].entry < 0)
+            continue;
+        prog_range_t r = { prog->functions[i].entry, 0, i };
+        vec_push(ranges, r);
+    }
+    if (vec_size(ranges))
+        qsort(ranges, vec_size(ranges), sizeof(*ranges), &prog_range_cmp);
+    for (i = 0; i < vec_size(ranges); i = k) {
+        size_t end = prog->code.size();
+        size_t st, j;
+        /* functions with the same entry share the body */
+        for (k = i + 1; k < vec_size(ranges) && ranges[k].first == ranges[i].first; ++k)
+            ;
+        if (k < vec_size(ranges))
+            end = ranges[k].first;
+        for (st = ranges[i].first; st < end; ++st) {
+            const qc_exec_statement_t *s = &prog->decoded[st];
+            size_t callee;
+            if (s->opcode >= INSTR_CALL0 && s->opcode <= INSTR_CALL8) {
+                callee   = any;
+                indirect = true;
+            } else if (s->opcode == QCVM_CALL && prog->functions[s->a->function].entry >= 0) {
+                callee = s->a->function;
+            } else {
+                continue;
+            }
+            for (j = i; j < k; ++j) {
+                callees[ranges[j].function].push_back(callee);
+                callers[callee].push_back(ranges[j].function);
+            }
+        }
+    }
+    for (i = 0; indirect && i < vec_size(ranges); ++i) {
+        callees[any].push_back(ranges[i].function);
+        callers[ranges[i].function].push_back(any);
+    }
+
+    /* find the functions whose locals overlap those of another function */
+    vec_free(ranges);
+    for (i = 0; i < nfuncs; ++i) {
+        if (prog->functions[i].entry < 0 || !prog->functions[i].locals)
+            continue;
+        prog_range_t r = { (qcint_t)prog->functions[i].firstlocal, (qcint_t)prog->functions[i].locals, i };
+        vec_push(ranges, r);
+    }
+    if (vec_size(ranges)) {
+        qcint_t end;
+        qsort(ranges, vec_size(ranges), sizeof(*ranges), &prog_range_cmp);
+        end = ranges[0].first;
+        for (i = 0; i < vec_size(ranges); ++i) {
+            if (end > ranges[i].first)
+                shared[ranges[i].function] = true;
+            if (i + 1 < vec_size(ranges) && ranges[i+1].first < ranges[i].first + ranges[i].count)
+                shared[ranges[i].function] = true;
+            if (ranges[i].first + ranges[i].count > end)
+                end = ranges[i].first + ranges[i].count;
+        }
+    }
+    vec_free(ranges);
+
+    /* recursive functions are the ones in a cycle, found with Tarjan's algorithm */
+    {
+        const size_t unvisited = (size_t)-1;
+        std::vector<size_t> index(nfuncs + 1, unvisited);
+        std::vector<size_t> low(nfuncs + 1, 0);
+        std::vector<bool>   onstack(nfuncs + 1, false);
+        std::vector<size_t> stack;
+        std::vector<std::pair<size_t, size_t>> frames; /* node, next callee */
+        size_t              counter = 0;
+
+        for (i = 0; i <= nfuncs; ++i) {
+            if (index[i] != unvisited)
+                continue;
+            frames.push_back(std::make_pair(i, (size_t)0));
+            while (!frames.empty()) {
+                size_t v = frames.back().first;
+                size_t e = frames.back().second;
+                if (!e && index[v] == unvisited) {
+                    index[v] = low[v] = counter++;
+                    stack.push_back(v);
+                    onstack[v] = true;
+                }
+                if (e < callees[v].size()) {
+                    size_t w = callees[v][e];
+                    frames.back().second++;
+                    if (index[w] == unvisited)
+                        frames.push_back(std::make_pair(w, (size_t)0));
+                    else if (onstack[w] && index[w] < low[v])
+                        low[v] = index[w];
+                    continue;
+                }
+                frames.pop_back();
+                if (!frames.empty() && low[v] < low[frames.back().first])
+                    low[frames.back().first] = low[v];
+                if (low[v] != index[v])
+                    continue;
+                /* v is the root of a component */
+                bool cycle = stack.back() != v;
+                size_t w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    onstack[w] = false;
+                    if (w < nfuncs)
+                        cyclic[w] = cycle;
+                } while (w != v);
+            }
+        }
+        for (i = 0; i < nfuncs; ++i) {
+            for (auto &it : callees[i])
+                if (it == i)
+                    cyclic[i] = true;
+        }
+    }
+
+    /* and finally which part of the locals can be in use further down the stack */
+    {
+        std::vector<size_t> visited(nfuncs + 1, (size_t)-1);
+        std::vector<size_t> queue;
+
+        for (i = 0; i < nfuncs; ++i) {
+            prog_section_function_t *f     = &prog->functions[i];
+            qcint_t                  first = f->firstlocal;
+            qcint_t                  end   = f->firstlocal + f->locals;
+            qcint_t                  lo    = end;
+            qcint_t                  hi    = first;
+            size_t                   at;
+
+            if (f->entry < 0 || !f->locals)
+                continue;
+            if (cyclic[i]) {
+                lo = first;
+                hi = end;
+            }
+            if (shared[i] && lo > first) {
+                queue.clear();
+                queue.push_back(i);
+                visited[i] = i;
+                for (at = 0; at < queue.size() && (lo > first || hi < end); ++at) {
+                    if (at == LAZYLOCALS_VISIT_LIMIT) {
+                        lo = first;
+                        hi = end;
+                        break;
+                    }
+                    for (auto &caller : callers[queue[at]]) {
+                        if (visited[caller] == i)
+                            continue;
+                        visited[caller] = i;
+                        queue.push_back(caller);
+                        if (caller == any)
+                            continue;
+                        prog_section_function_t *g = &prog->functions[caller];
+                        qcint_t from = (qcint_t)g->firstlocal;
+                        qcint_t to   = (qcint_t)(g->firstlocal + g->locals);
+                        if (from < first) from = first;
+                        if (to   > end)   to   = end;
+                        if (from >= to)
+                            continue;
+                        if (from < lo) lo = from;
+                        if (to   > hi) hi = to;
+                    }
+                }
+            }
+            if (lo < hi) {
+                prog->funcinfo[i].savefirst = lo - first;
+                prog->funcinfo[i].savecount = hi - lo;
+            }
+        }
+    }
+}
+
+#undef LAZYLOCALS_VISIT_LIMIT
+
+/***********************************************************************
+ * Record and replay
+ */
+
+/*
+ * A log starts with QCVM_LOG_MAGIC, the crc16 and the statement count of
+ * the program, and continues with events.  Every event is a varint with
+ * its kind in the low 2 bits and an argument above them:
+ *   RUN     arg statements ran, each following the one before
+ *   JUMP    the next statement ran, arg is its distance from the one
+ *           after the last, zigzag encoded
+ *   BUILTIN builtin number arg was called, followed by argc, the 3*argc
+ *           parameter values and, after the events of anything it ran,
+ *           the 3 return values, all zigzag encoded varints
+ *   ENTER   prog_exec ran function arg
+ */
+#define QCVM_LOG_MAGIC "QCVMLOG1"
+
+enum {
+    QCVM_LOG_RUN,
+    QCVM_LOG_JUMP,
+    QCVM_LOG_BUILTIN,
+    QCVM_LOG_ENTER
+};
+
+/* what is buffered before it is written out */
+#define QCVM_LOG_BUFFER 65536
+
+static void prog_tracelog_put(qc_exec_tracelog_t *log, uint64_t value) {
+    while (value >= 0x80) {
+        vec_push(log->data, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    vec_push(log->data, (uint8_t)value);
+}
+
+static GMQCC_INLINE uint64_t prog_tracelog_zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static GMQCC_INLINE int64_t prog_tracelog_unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void prog_tracelog_flush(qc_exec_tracelog_t *log) {
+    if (log->run) {
+        prog_tracelog_put(log, (uint64_t)log->run << 2 | QCVM_LOG_RUN);
+        log->run = 0;
+    }
+    if (vec_size(log->data) >= QCVM_LOG_BUFFER) {
+        if (fwrite(log->data, 1, vec_size(log->data), log->file) != vec_size(log->data))
+            log->failed = true;
+        vec_shrinkto(log->data, 0);
+    }
+}
+
+/* only the first difference is reported, anything after it fails quietly */
+static bool prog_tracelog_diverged(qc_program_t *prog, const char *what) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    if (!log->failed)
+        qcvmerror(prog, "`%s` diverged from the replayed log after statement %lu: %s",
+                  prog->filename, (unsigned long)log->last, what);
+    else
+        prog->vmerror++;
+    log->failed = true;
+    return false;
+}
+
+static bool prog_tracelog_get(qc_program_t *prog, uint64_t *value) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    uint64_t v = 0;
+    unsigned shift = 0;
+    uint8_t  byte;
+
+    do {
+        if (log->at >= vec_size(log->data) || shift > 63)
+            return prog_tracelog_diverged(prog, "the log ends");
+        byte = log->data[log->at++];
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    *value = v;
+    return true;
+}
+
+static bool prog_tracelog_getint(qc_program_t *prog, int64_t *value) {
+    uint64_t v;
+    if (!prog_tracelog_get(prog, &v))
+        return false;
+    *value = prog_tracelog_unzigzag(v);
+    return true;
+}
+
+/* reads an event which has to be of the given kind */
+static bool prog_tracelog_event(qc_program_t *prog, int kind, uint64_t *arg) {
+    uint64_t v;
+    if (!prog_tracelog_get(prog, &v))
+        return false;
+    if ((int)(v & 3) != kind)
+        return prog_tracelog_diverged(prog, "the log has a different event");
+    *arg = v >> 2;
+    return true;
+}
+
+static void prog_tracelog_enter(qc_program_t *prog, prog_section_function_t *func) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    uint64_t fn = func - &prog->functions[0];
+    uint64_t arg;
+
+    if (!log->replay) {
+        prog_tracelog_flush(log);
+        prog_tracelog_put(log, fn << 2 | QCVM_LOG_ENTER);
+    } else if (log->run) {
+        prog_tracelog_diverged(prog, "the log runs on");
+        return;
+    } else if (!prog_tracelog_event(prog, QCVM_LOG_ENTER, &arg))
+        return;
+    else if (arg != fn) {
+        prog_tracelog_diverged(prog, "the log enters another function");
+        return;
+    }
+    log->last = func->entry - 1;
+}
+
+static bool prog_tracelog_statement(qc_program_t *prog, size_t stmt) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    uint64_t arg;
+
+    if (!log->replay) {
+        if (stmt != log->last + 1) {
+            prog_tracelog_flush(log);
+            prog_tracelog_put(log, prog_tracelog_zigzag((int64_t)stmt - (int64_t)(log->last + 1)) << 2 | QCVM_LOG_JUMP);
+        } else
+            log->run++;
+        log->last = stmt;
+        return true;
+    }
+
+    if (!log->run) {
+        uint64_t v;
+        if (!prog_tracelog_get(prog, &v))
+            return false;
+        arg = v >> 2;
+        if ((v & 3) == QCVM_LOG_JUMP) {
+            if ((int64_t)stmt - (int64_t)(log->last + 1) != prog_tracelog_unzigzag(arg))
+                return prog_tracelog_diverged(prog, "the log jumps elsewhere");
+            log->last = stmt;
+            return true;
+        }
+        if ((v & 3) != QCVM_LOG_RUN)
+            return prog_tracelog_diverged(prog, "the log has a different event");
+        log->run = arg;
+    }
+    if (stmt != log->last + 1)
+        return prog_tracelog_diverged(prog, "the log runs on");
+    log->run--;
+    log->last = stmt;
+    return true;
+}
+
+/*
+ * Calls a builtin while recording or replaying.  A replay still calls
+ * it, for what it does to the program, but the log decides its result.
+ */
+static int prog_tracelog_builtin(qc_program_t *prog, qc_exec_callcache_t *call) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    qcint_t *params = &prog->globals[OFS_PARM0];
+    qcint_t *ret    = &prog->globals[OFS_RETURN];
+    uint64_t number = -call->target->entry;
+    size_t   count  = 3 * (size_t)prog->argc;
+    size_t   i;
+    uint64_t arg;
+    uint64_t argc;
+    int64_t  value;
+    int      result;
+
+    if (!log->replay) {
+        prog_tracelog_flush(log);
+        prog_tracelog_put(log, number << 2 | QCVM_LOG_BUILTIN);
+        prog_tracelog_put(log, prog->argc);
+        for (i = 0; i < count; ++i)
+            prog_tracelog_put(log, prog_tracelog_zigzag(params[i]));
+        result = call->builtin(prog);
+        for (i = 0; i < 3; ++i)
+            prog_tracelog_put(log, prog_tracelog_zigzag(ret[i]));
+        return result;
+    }
+
+    if (log->run) {
+        prog_tracelog_diverged(prog, "the log runs on");
+        return 0;
+    }
+    if (!prog_tracelog_event(prog, QCVM_LOG_BUILTIN, &arg) || !prog_tracelog_get(prog, &argc))
+        return 0;
+    if (arg != number || argc != (uint64_t)prog->argc) {
+        prog_tracelog_diverged(prog, "the log calls another builtin");
+        return 0;
+    }
+    for (i = 0; i < count; ++i) {
+        if (!prog_tracelog_getint(prog, &value))
+            return 0;
+        if (value != params[i]) {
+            prog_tracelog_diverged(prog, "the builtin gets different parameters");
+            return 0;
+        }
+    }
+    result = call->builtin(prog);
+    for (i = 0; i < 3; ++i) {
+        if (!prog_tracelog_getint(prog, &value))
+            return 0;
+        ret[i] = (qcint_t)value;
+    }
+    return result;
+}
+
+static qc_exec_tracelog_t *prog_tracelog_new(qc_program_t *prog, bool replay) {
+    qc_exec_tracelog_t *log = (qc_exec_tracelog_t*)mem_a(sizeof(qc_exec_tracelog_t));
+    memset(log, 0, sizeof(*log));
+    log->replay = replay;
+    if (prog->tracelog)
+        prog_trace_end(prog);
+    prog->tracelog = log;
+    return log;
+}
+
+/*
+ * Starts logging every prog_exec of the program to filename, until
+ * prog_trace_end.  The log is binary, see QCVM_LOG_MAGIC.  Programs run
+ * with the tracing loop while it is on.
+ */
+bool prog_trace_record(qc_program_t *prog, const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    qc_exec_tracelog_t *log;
+
+    if (!file) {
+        fprintf(stderr, "failed to open `%s` for writing: %s\n", filename, util_strerror(errno));
+        return false;
+    }
+    log = prog_tracelog_new(prog, false);
+    log->file = file;
+    vec_append(log->data, sizeof(QCVM_LOG_MAGIC) - 1, QCVM_LOG_MAGIC);
+    vec_push(log->data, (uint8_t)(prog->crc16 & 0xFF));
+    vec_push(log->data, (uint8_t)(prog->crc16 >> 8));
+    prog_tracelog_put(log, prog->code.size());
+    return true;
+}
+
+/*
+ * Replays a log prog_trace_record wrote for the same program: prog_exec
+ * checks that it runs the statements and calls the builtins the log has,
+ * and builtins return what they returned then.  The first difference is
+ * an error.
+ */
+bool prog_trace_replay(qc_program_t *prog, const char *filename) {
+    FILE    *file = fopen(filename, "rb");
+    uint8_t  buffer[4096];
+    size_t   read;
+    uint64_t count;
+    qc_exec_tracelog_t *log;
+
+    if (!file) {
+        fprintf(stderr, "failed to open `%s`: %s\n", filename, util_strerror(errno));
+        return false;
+    }
+    log = prog_tracelog_new(prog, true);
+    while ((read = fread(buffer, 1, sizeof(buffer), file)))
+        vec_append(log->data, read, buffer);
+    fclose(file);
+
+    if (vec_size(log->data) < sizeof(QCVM_LOG_MAGIC) - 1 + 2 ||
+        memcmp(log->data, QCVM_LOG_MAGIC, sizeof(QCVM_LOG_MAGIC) - 1))
+    {
+        fprintf(stderr, "`%s` is not a qcvm log\n", filename);
+        log->failed = true;
+        prog_trace_end(prog);
+        return false;
+    }
+    log->at = sizeof(QCVM_LOG_MAGIC) - 1 + 2;
+    if ((log->data[log->at - 2] | log->data[log->at - 1] << 8) != prog->crc16 ||
+        !prog_tracelog_get(prog, &count) || count != prog->code.size())
+    {
+        fprintf(stderr, "`%s` was recorded with another program than `%s`\n", filename, prog->filename);
+        log->failed = true;
+        prog_trace_end(prog);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Stops recording or replaying.  Returns false when the log could not be
+ * written, or the replay diverged or stopped before the end of the log.
+ */
+bool prog_trace_end(qc_program_t *prog) {
+    qc_exec_tracelog_t *log = prog->tracelog;
+    bool ok;
+
+    if (!log)
+        return true;
+    if (!log->replay) {
+        prog_tracelog_flush(log);
+        if (vec_size(log->data) &&
+            fwrite(log->data, 1, vec_size(log->data), log->file) != vec_size(log->data))
+            log->failed = true;
+        if (fclose(log->file))
+            log->failed = true;
+        if (log->failed)
+            fprintf(stderr, "failed to write the log of `%s`\n", prog->filename);
+    } else if (!log->failed && (log->run || log->at != vec_size(log->data))) {
+        fprintf(stderr, "`%s` stopped before the end of the replayed log\n", prog->filename);
+        log->failed = true;
+    }
+    ok = !log->failed;
+    vec_free(log->data);
+    mem_d(log);
+    prog->tracelog = nullptr;
+    return ok;
+}
+
+#undef QCVM_LOG_BUFFER
+
 /***********************************************************************
  * VM code
  */
 
-const char* prog_getstring(qc_program_t *prog, qcint_t str) {
-    /* cast for return required for C++ */
-    if (str < 0 || str >= (qcint_t)prog->strings.size())
-        return  "<<<invalid string>>>";
+/*
+ * The vector instructions.  With SSE the components are worked on in one
+ * register, in the same operations and order as the scalar versions, so
+ * both give the same bits.  Vectors are only 3 floats, so they are read
+ * and written as a pair and a single, never past their end.
+ */
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+
+static GMQCC_INLINE __m128 prog_vec_load(const qcfloat_t *v) {
+    return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)v), _mm_load_ss(v + 2));
+}
+
+static GMQCC_INLINE void prog_vec_store(qcfloat_t *out, __m128 v) {
+    _mm_storel_pi((__m64*)out, v);
+    _mm_store_ss(out + 2, _mm_movehl_ps(v, v));
+}
+
+static GMQCC_INLINE void prog_vec_add(qcfloat_t *out, const qcfloat_t *a, const qcfloat_t *b) {
+    prog_vec_store(out, _mm_add_ps(prog_vec_load(a), prog_vec_load(b)));
+}
+
+static GMQCC_INLINE void prog_vec_sub(qcfloat_t *out, const qcfloat_t *a, const qcfloat_t *b) {
+    prog_vec_store(out, _mm_sub_ps(prog_vec_load(a), prog_vec_load(b)));
+}
+
+static GMQCC_INLINE void prog_vec_scale(qcfloat_t *out, const qcfloat_t *v, qcfloat_t f) {
+    prog_vec_store(out, _mm_mul_ps(prog_vec_load(v), _mm_set1_ps(f)));
+}
+
+/* (a0*b0 + a1*b1) + a2*b2 */
+static GMQCC_INLINE qcfloat_t prog_vec_dot(const qcfloat_t *a, const qcfloat_t *b) {
+    __m128 p = _mm_mul_ps(prog_vec_load(a), prog_vec_load(b));
+    __m128 s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(p, p)));
+}
+
+/* like ==, so -0 equals 0 and NaN equals nothing */
+static GMQCC_INLINE bool prog_vec_eq(const qcfloat_t *a, const qcfloat_t *b) {
+    return (_mm_movemask_ps(_mm_cmpeq_ps(prog_vec_load(a), prog_vec_load(b))) & 7) == 7;
+}
+#else
+static GMQCC_INLINE void prog_vec_add(qcfloat_t *out, const qcfloat_t *a, const qcfloat_t *b) {
+    out[0] = a[0] + b[0];
+    out[1] = a[1] + b[1];
+    out[2] = a[2] + b[2];
+}
+
+static GMQCC_INLINE void prog_vec_sub(qcfloat_t *out, const qcfloat_t *a, const qcfloat_t *b) {
+    out[0] = a[0] - b[0];
+    out[1] = a[1] - b[1];
+    out[2] = a[2] - b[2];
+}
+
+static GMQCC_INLINE void prog_vec_scale(qcfloat_t *out, const qcfloat_t *v, qcfloat_t f) {
+    out[0] = f * v[0];
+    out[1] = f * v[1];
+    out[2] = f * v[2];
+}
+
+static GMQCC_INLINE qcfloat_t prog_vec_dot(const qcfloat_t *a, const qcfloat_t *b) {
+    return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+static GMQCC_INLINE bool prog_vec_eq(const qcfloat_t *a, const qcfloat_t *b) {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+#endif
+
+/*
+ * A temp string is valid while the ring hasn't come back around to it: it
+ * is either from the current generation and below tempstring_at, or from
+ * the previous generation and in the part not overwritten yet.
+ */
+static bool prog_tempstring_valid(qc_program_t *prog, uint32_t gen, size_t at) {
+    uint32_t cur = prog->tempstring_gen % VM_TEMPSTRING_GENS;
+    if (gen == cur)
+        return at < prog->tempstring_at;
+    if (gen == (prog->tempstring_gen - 1) % VM_TEMPSTRING_GENS)
+        return at >= prog->tempstring_at && at < prog->tempstring_prevend;
+    return false;
+}
+
+const char* prog_getstring(qc_program_t *prog, qcint_t str) {
+    if (str < 0) {
+        uint32_t handle = (uint32_t)(-1 - str);
+        size_t   at     = handle & (VM_TEMPSTRING_SIZE - 1);
+        if (!prog_tempstring_valid(prog, handle >> VM_TEMPSTRING_BITS, at))
+            return "<<<stale tempstring>>>";
+        return prog->tempstrings + at;
+    }
+
+    /* cast for return required for C++ */
+    if (str >= (qcint_t)prog->strings.size())
+        return  "<<<invalid string>>>";
+
+    return &prog->strings[0] + str;
+}
+
+/*
+ * Builds the lookups by offset and by name, prog_entfield, prog_getdef and
+ * prog_find_* used to scan the sections.
+ */
+static void prog_index_offsets(uint32_t **table, const qc_section_t<prog_section_def_t> &defs) {
+    size_t size = 0;
+    size_t i;
+
+    for (i = 0; i < defs.size(); ++i)
+        if (defs[i].offset >= size)
+            size = defs[i].offset + 1;
+    memset(vec_add(*table, size), 0, size * sizeof(**table));
+
+    /* backwards, so the first def of an offset is the one left */
+    for (i = defs.size(); i--; )
+        (*table)[defs[i].offset] = i + 1;
+}
+
+template<typename T>
+static hash_table_t *prog_index_names(qc_program_t *prog, const qc_section_t<T> &section) {
+    hash_table_t *table = util_htnew(section.size() ? section.size() : 1);
+    size_t        i;
 
-    return &prog->strings[0] + str;
+    /* forwards, so the last one of a name replaces the others */
+    for (i = 0; i < section.size(); ++i)
+        util_htset(table, prog_getstring(prog, section[i].name), (void*)(uintptr_t)(i + 1));
+    return table;
+}
+
+static void prog_index(qc_program_t *prog) {
+    prog_index_offsets(&prog->defbyoffset,   prog->defs);
+    prog_index_offsets(&prog->fieldbyoffset, prog->fields);
+    prog->defbyname      = prog_index_names(prog, prog->defs);
+    prog->fieldbyname    = prog_index_names(prog, prog->fields);
+    prog->functionbyname = prog_index_names(prog, prog->functions);
+}
+
+static void prog_index_free(qc_program_t *prog) {
+    vec_free(prog->defbyoffset);
+    vec_free(prog->fieldbyoffset);
+    if (prog->defbyname)      util_htdel(prog->defbyname);
+    if (prog->fieldbyname)    util_htdel(prog->fieldbyname);
+    if (prog->functionbyname) util_htdel(prog->functionbyname);
 }
 
 prog_section_def_t* prog_entfield(qc_program_t *prog, qcint_t off) {
-    for (auto &it : prog->fields)
-        if (it.offset == off)
-            return &it;
-    return nullptr;
+    if (off < 0 || (size_t)off >= vec_size(prog->fieldbyoffset) || !prog->fieldbyoffset[off])
+        return nullptr;
+    return &prog->fields[prog->fieldbyoffset[off] - 1];
 }
 
 prog_section_def_t* prog_getdef(qc_program_t *prog, qcint_t off)
 {
-    for (auto &it : prog->defs)
-        if (it.offset == off)
-            return &it;
-    return nullptr;
+    if (off < 0 || (size_t)off >= vec_size(prog->defbyoffset) || !prog->defbyoffset[off])
+        return nullptr;
+    return &prog->defs[prog->defbyoffset[off] - 1];
+}
+
+prog_section_def_t* prog_find_global(qc_program_t *prog, const char *name) {
+    uintptr_t i = (uintptr_t)util_htget(prog->defbyname, name);
+    return i ? &prog->defs[i - 1] : nullptr;
+}
+
+prog_section_def_t* prog_find_field(qc_program_t *prog, const char *name) {
+    uintptr_t i = (uintptr_t)util_htget(prog->fieldbyname, name);
+    return i ? &prog->fields[i - 1] : nullptr;
 }
 
+prog_section_function_t* prog_find_function(qc_program_t *prog, const char *name) {
+    uintptr_t i = (uintptr_t)util_htget(prog->functionbyname, name);
+    return i ? &prog->functions[i - 1] : nullptr;
+}
+
+/*
+ * Marks count values of the entity data from from as changed since the
+ * last snapshot, growing the bitmap to the size of the entity data.
+ */
+static void prog_entdirty_range(qc_program_t *prog, size_t from, size_t count) {
+    size_t blocks = (vec_size(prog->entitydata) + VM_SNAPSHOT_BLOCK - 1) / VM_SNAPSHOT_BLOCK;
+    size_t words  = (blocks + 31) / 32;
+    size_t b;
+
+    if (vec_size(prog->entitydirty) < words) {
+        size_t add = words - vec_size(prog->entitydirty);
+        memset(vec_add(prog->entitydirty, add), 0, add * sizeof(prog->entitydirty[0]));
+    }
+    if (!count)
+        return;
+    for (b = from / VM_SNAPSHOT_BLOCK; b <= (from + count - 1) / VM_SNAPSHOT_BLOCK; ++b)
+        prog->entitydirty[b >> 5] |= 1u << (b & 31);
+}
+
+/* marks a single value of the entity data as changed, for the stores */
+static GMQCC_INLINE qcint_t *prog_entdirty(qc_program_t *prog, qcint_t *at) {
+    size_t b = (size_t)(at - prog->entitydata) / VM_SNAPSHOT_BLOCK;
+    prog->entitydirty[b >> 5] |= 1u << (b & 31);
+    return at;
+}
+
+/* only for the row layout, where an entity's fields are next to each other */
 qcany_t* prog_getedict(qc_program_t *prog, qcint_t e) {
-    if (e >= (qcint_t)vec_size(prog->entitypool)) {
+    if (prog->entitycolumns) {
+        prog->vmerror++;
+        fprintf(stderr, "Accessing edict %i as a whole with column entity storage\n", (int)e);
+        return nullptr;
+    }
+    if (e >= prog->entities) {
         prog->vmerror++;
         fprintf(stderr, "Accessing out of bounds edict %i\n", (int)e);
         e = 0;
     }
+    /* the host can change any of it through the pointer */
+    prog_entdirty_range(prog, prog->entityfields * e, prog->entityfields);
     return (qcany_t*)(prog->entitydata + (prog->entityfields * e));
 }
 
-static qcint_t prog_spawn_entity(qc_program_t *prog) {
-    char  *data;
-    qcint_t  e;
-    for (e = 0; e < (qcint_t)vec_size(prog->entitypool); ++e) {
-        if (!prog->entitypool[e]) {
-            data = (char*)(prog->entitydata + (prog->entityfields * e));
-            memset(data, 0, prog->entityfields * sizeof(qcint_t));
+/*
+ * A single field of an entity, for either layout.  With columns the
+ * components of a vector field are fieldstride apart.
+ */
+qcany_t* prog_edictfield(qc_program_t *prog, qcint_t e, qcint_t field) {
+    size_t at;
+    size_t i;
+
+    if (e >= prog->entities) {
+        prog->vmerror++;
+        fprintf(stderr, "Accessing out of bounds edict %i\n", (int)e);
+        e = 0;
+    }
+    /* the host can write through the pointer, to a vector field as well */
+    at = e * prog->entitystride + field * prog->fieldstride;
+    for (i = 0; i < 3 && at + i * prog->fieldstride < vec_size(prog->entitydata); ++i)
+        prog_entdirty(prog, prog->entitydata + at + i * prog->fieldstride);
+    return (qcany_t*)(prog->entitydata + at);
+}
+
+/* where the entity data a pointer from INSTR_ADDRESS points to is stored */
+static GMQCC_INLINE qcint_t *prog_entpointer(qc_program_t *prog, qcint_t p) {
+    if (!prog->entitycolumns)
+        return prog->entitydata + p;
+    return prog->entitydata + (p % prog->entityfields) * prog->fieldstride + p / prog->entityfields;
+}
+
+/* grows the entity data by VM_ENTITY_CHUNK rows, or twice the size for columns */
+static void prog_grow_entities(qc_program_t *prog) {
+    size_t   fields = prog->entityfields;
+    size_t   oldcap;
+    size_t   newcap;
+    qcint_t *data;
+    size_t   f;
+
+    prog->stats.entitygrowths++;
+
+    if (!prog->entitycolumns) {
+        oldcap = vec_size(prog->entitydata);
+        memset(vec_add(prog->entitydata, fields * VM_ENTITY_CHUNK), 0,
+               fields * VM_ENTITY_CHUNK * sizeof(qcint_t));
+        prog->entitycapacity += VM_ENTITY_CHUNK;
+        prog_entdirty_range(prog, oldcap, fields * VM_ENTITY_CHUNK);
+        return;
+    }
+
+    /*
+     * Grow in place and move the columns apart starting with the last one,
+     * so no column is overwritten before it has been moved.
+     */
+    oldcap = prog->entitycapacity;
+    newcap = oldcap * 2;
+    vec_add(prog->entitydata, fields * (newcap - oldcap));
+    data = prog->entitydata;
+    for (f = fields; f-- > 0; ) {
+        memmove(data + f * newcap, data + f * oldcap, oldcap * sizeof(qcint_t));
+        memset(data + f * newcap + oldcap, 0, (newcap - oldcap) * sizeof(qcint_t));
+    }
+    prog->entitycapacity = newcap;
+    prog->fieldstride    = newcap;
+    prog_entdirty_range(prog, 0, vec_size(prog->entitydata));
+}
+
+/* Counts the trailing zero bits, the first free entity of a bitmap word. */
+#ifdef _MSC_VER
+    static GMQCC_INLINE uint32_t prog_ctz(uint32_t x) {
+        unsigned long r = 0;
+        _BitScanForward(&r, x);
+        return r;
+    }
+#elif defined(__GNUC__) || defined(__CLANG__)
+#   define prog_ctz(X) ((uint32_t)__builtin_ctz((X)))
+#else
+    static GMQCC_INLINE uint32_t prog_ctz(uint32_t x) {
+        uint32_t r = 0;
+        while (!(x & 1)) {
+            x >>= 1;
+            ++r;
+        }
+        return r;
+    }
+#endif
+
+#define ENTITY_FREE(prog, e) ((prog)->entityfree[(e) >> 5] & (1u << ((e) & 31)))
+
+static qcint_t prog_reuse_lowest(qc_program_t *prog) {
+    size_t w = prog->entityfreeword;
+    while (!prog->entityfree[w])
+        ++w;
+    prog->entityfreeword = w;
+    return (qcint_t)(w * 32 + prog_ctz(prog->entityfree[w]));
+}
+
+static qcint_t prog_reuse_listed(qc_program_t *prog) {
+    qcint_t e;
+    /* entries can be stale when the reuse order was changed midway */
+    while (prog->entityfreehead < vec_size(prog->entityfreelist)) {
+        if (prog->entityreuse == VMENT_REUSE_FIFO)
+            e = prog->entityfreelist[prog->entityfreehead++];
+        else {
+            e = vec_last(prog->entityfreelist);
+            vec_pop(prog->entityfreelist);
+        }
+        if (ENTITY_FREE(prog, e))
             return e;
+    }
+    /* entities freed before switching to a list are only in the bitmap */
+    vec_shrinkto(prog->entityfreelist, 0);
+    prog->entityfreehead = 0;
+    return prog_reuse_lowest(prog);
+}
+
+/*
+ * Free entities are kept in a bitmap, which gives the lowest free one in
+ * a few word reads.  With VMENT_REUSE_LIFO or _FIFO they are also queued
+ * as they are freed and taken from there.  The entity data grows in
+ * chunks, see prog_grow_entities, the part after the last entity is kept
+ * zeroed.
+ */
+static qcint_t prog_spawn_entity(qc_program_t *prog) {
+    qcint_t e;
+
+    prog->stats.spawned++;
+    if (prog->entityfreecount) {
+        prog->stats.reused++;
+        if (prog->entityreuse == VMENT_REUSE_LOWEST)
+            e = prog_reuse_lowest(prog);
+        else
+            e = prog_reuse_listed(prog);
+        prog->entityfree[e >> 5] &= ~(1u << (e & 31));
+        prog->entityfreecount--;
+        prog->entitypool[e] = true;
+        if (!prog->entitycolumns) {
+            memset(prog->entitydata + prog->entityfields * e, 0, prog->entityfields * sizeof(qcint_t));
+            prog_entdirty_range(prog, prog->entityfields * e, prog->entityfields);
+        } else {
+            size_t f;
+            for (f = 0; f < prog->entityfields; ++f)
+                *prog_entdirty(prog, &prog->entitydata[f * prog->fieldstride + e]) = 0;
         }
+        return e;
     }
+
+    e = prog->entities++;
     vec_push(prog->entitypool, true);
-    prog->entities++;
-    data = (char*)vec_add(prog->entitydata, prog->entityfields);
-    memset(data, 0, prog->entityfields * sizeof(qcint_t));
+    if (!(e & 31))
+        vec_push(prog->entityfree, 0);
+    if ((size_t)prog->entities > prog->entitycapacity)
+        prog_grow_entities(prog);
     return e;
 }
 
@@ -236,7 +2097,7 @@ static void prog_free_entity(qc_program_t *prog, qcint_t e) {
         fprintf(stderr, "Trying to free world entity\n");
         return;
     }
-    if (e >= (qcint_t)vec_size(prog->entitypool)) {
+    if (e < 0 || e >= prog->entities) {
         prog->vmerror++;
         fprintf(stderr, "Trying to free out of bounds entity\n");
         return;
@@ -246,29 +2107,105 @@ static void prog_free_entity(qc_program_t *prog, qcint_t e) {
         fprintf(stderr, "Double free on entity\n");
         return;
     }
+    prog->stats.freed++;
     prog->entitypool[e] = false;
+    prog->entityfree[e >> 5] |= 1u << (e & 31);
+    prog->entityfreecount++;
+    if ((size_t)(e >> 5) < prog->entityfreeword)
+        prog->entityfreeword = e >> 5;
+
+    if (prog->entityreuse != VMENT_REUSE_LOWEST) {
+        /* drop what FIFO already consumed once it is half of the queue */
+        if (prog->entityfreehead && prog->entityfreehead * 2 >= vec_size(prog->entityfreelist)) {
+            vec_remove(prog->entityfreelist, 0, prog->entityfreehead);
+            prog->entityfreehead = 0;
+        }
+        vec_push(prog->entityfreelist, e);
+    }
 }
 
+#undef ENTITY_FREE
+
 qcint_t prog_tempstring(qc_program_t *prog, const char *str) {
-    size_t len = strlen(str);
-    size_t at = prog->tempstring_at;
+    size_t   len = strlen(str) + 1;
+    size_t   at;
+    size_t   b;
+    uint32_t handle;
+
+    if (len > VM_TEMPSTRING_SIZE) {
+        qcvmerror(prog, "temp string of %lu bytes does not fit the temp string ring",
+                  (unsigned long)len);
+        return 0;
+    }
+
+    /*
+     * when we reach the end we start over in a new generation, the older
+     * strings stay valid until they are overwritten
+     */
+    if (prog->tempstring_at + len > VM_TEMPSTRING_SIZE) {
+        prog->tempstring_prevend = prog->tempstring_at;
+        prog->tempstring_at      = 0;
+        prog->tempstring_gen++;
+        prog->stats.tempwraps++;
+    }
 
-    /* when we reach the end we start over */
-    if (at + len >= prog->strings.size())
-        at = prog->tempstring_start;
+    prog->stats.tempstrings++;
+    prog->stats.tempbytes += len;
 
-    /* when it doesn't fit, reallocate */
-    if (at + len >= prog->strings.size())
-    {
-        prog->strings.resize(prog->strings.size() + len+1);
-        memcpy(&prog->strings[0] + at, str, len+1);
-        return at;
+    at = prog->tempstring_at;
+    memcpy(prog->tempstrings + at, str, len);
+    prog->tempstring_at += len;
+    for (b = at / (VM_SNAPSHOT_BLOCK * sizeof(qcint_t)); b <= (at + len - 1) / (VM_SNAPSHOT_BLOCK * sizeof(qcint_t)); ++b)
+        prog->tempdirty |= (uint64_t)1 << b;
+
+    handle = (prog->tempstring_gen % VM_TEMPSTRING_GENS) << VM_TEMPSTRING_BITS | (uint32_t)at;
+    return -1 - (qcint_t)handle;
+}
+
+/*
+ * Drops all temp strings, meant to be called by the host between frames.
+ * Handles still held are reported as stale afterwards.
+ */
+void prog_tempstring_reset(qc_program_t *prog) {
+    prog->tempstring_at      = 0;
+    prog->tempstring_prevend = 0;
+    prog->tempstring_gen++;
+}
+
+/*
+ * Builtins are looked up by number from the progs, definitions without a
+ * number are bound to the number the progs declared for the name. Returns
+ * how many of them were bound, names the progs don't declare are skipped.
+ */
+size_t prog_register_builtins(qc_program_t *prog, const prog_builtin_def_t *defs, size_t count) {
+    size_t bound = 0;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        qcint_t number = defs[i].number;
+
+        if (!number && defs[i].name) {
+            prog_section_function_t *func = prog_find_function(prog, defs[i].name);
+            if (func && func->entry < 0)
+                number = -func->entry;
+        }
+        if (number <= 0)
+            continue;
+
+        if ((size_t)number >= vec_size(prog->builtins)) {
+            size_t grow = (size_t)number + 1 - vec_size(prog->builtins);
+            memset(vec_add(prog->builtins, grow), 0, grow * sizeof(prog->builtins[0]));
+        }
+        prog->builtins[number] = defs[i].func;
+        bound++;
     }
 
-    /* when it fits, just copy */
-    memcpy(&prog->strings[0] + at, str, len+1);
-    prog->tempstring_at += len+1;
-    return at;
+    prog->builtins_count = vec_size(prog->builtins);
+
+    /* the call caches may hold the builtins replaced */
+    if (vec_size(prog->callcaches))
+        memset(prog->callcaches, 0, vec_size(prog->callcaches) * sizeof(prog->callcaches[0]));
+    return bound;
 }
 
 static size_t print_escaped_string(const char *str, size_t maxlen) {
@@ -305,7 +2242,7 @@ static size_t print_escaped_string(const char *str, size_t maxlen) {
 }
 
 static void trace_print_global(qc_program_t *prog, unsigned int glob, int vtype) {
-    static char spaces[28+1] = "                            ";
+    static const char spaces[28+1] = "                            ";
     prog_section_def_t *def;
     qcany_t    *value;
     int       len;
@@ -358,9 +2295,8 @@ static void trace_print_global(qc_program_t *prog, unsigned int glob, int vtype)
     }
 done:
     if (len < (int)sizeof(spaces)-1) {
-        spaces[sizeof(spaces)-1-len] = 0;
-        fputs(spaces, stdout);
-        spaces[sizeof(spaces)-1-len] = ' ';
+        /* the padding is shared by every program, so it is not modified */
+        fwrite(spaces, 1, sizeof(spaces)-1-len, stdout);
     }
 }
 
@@ -461,15 +2397,109 @@ static void prog_print_statement(qc_program_t *prog, prog_section_statement_t *s
     }
 }
 
+static uint64_t prog_profile_clock(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* makes the node of func below the current one the current one, returns the old one */
+static size_t prog_profile_enter(qc_program_t *prog, prog_section_function_t *func) {
+    qcint_t function = (qcint_t)(func - &prog->functions[0]);
+    size_t  parent   = prog->profnode;
+    size_t  node;
+
+    if (!prog->profnodes) {
+        qc_exec_profnode_t root;
+        memset(&root, 0, sizeof(root));
+        vec_push(prog->profnodes, root);
+    }
+
+    for (node = prog->profnodes[parent].child; node; node = prog->profnodes[node].next) {
+        if (prog->profnodes[node].function == function)
+            break;
+    }
+    if (!node) {
+        qc_exec_profnode_t add;
+        memset(&add, 0, sizeof(add));
+        add.function = function;
+        add.parent   = parent;
+        add.next     = prog->profnodes[parent].child;
+        node         = vec_size(prog->profnodes);
+        vec_push(prog->profnodes, add);
+        prog->profnodes[parent].child = node;
+    }
+
+    prog->profnodes[node].calls++;
+    prog->profnodes[node].entered = prog_profile_clock();
+    prog->profnode = node;
+    return parent;
+}
+
+static void prog_profile_leave(qc_program_t *prog, size_t parent) {
+    qc_exec_profnode_t *node = &prog->profnodes[prog->profnode];
+    node->time += prog_profile_clock() - node->entered;
+    prog->profnode = parent;
+}
+
+/*
+ * Fills the cache of a call site calling function.  A call which can't be
+ * made raises its error and leaves the cache as it was.
+ */
+static bool prog_call_resolve(qc_program_t *prog, qc_exec_callcache_t *cache, qcint_t function) {
+    prog_section_function_t *target;
+    prog_builtin_t           builtin = nullptr;
+
+    if (!function)
+        qcvmerror(prog, "nullptr function in `%s`", prog->filename);
+    if (function <= 0 || function >= (qcint_t)prog->functions.size()) {
+        qcvmerror(prog, "CALL outside the program in `%s`", prog->filename);
+        return false;
+    }
+
+    target = &prog->functions[function];
+    if (target->entry < 0) {
+        /* negative statements are built in functions */
+        qcint_t builtinnumber = -target->entry;
+        if (builtinnumber >= (qcint_t)prog->builtins_count || !prog->builtins[builtinnumber]) {
+            qcvmerror(prog, "No such builtin #%i in %s! Try updating your gmqcc sources",
+                      builtinnumber, prog->filename);
+            return false;
+        }
+        builtin = prog->builtins[builtinnumber];
+    }
+
+    cache->function = function;
+    cache->target   = target;
+    cache->builtin  = builtin;
+    return true;
+}
+
+/*
+ * Makes sure the cache of a call site holds function, every call goes
+ * through this.  0 is never cached, so an empty cache doesn't match it.
+ */
+static GMQCC_INLINE bool prog_call_lookup(qc_program_t *prog, qc_exec_callcache_t *cache, qcint_t function) {
+    if (function && function == cache->function)
+        return true;
+    return prog_call_resolve(prog, cache, function);
+}
+
 static qcint_t prog_enterfunction(qc_program_t *prog, prog_section_function_t *func) {
+    const qc_exec_function_t *info = &prog->funcinfo[func - &prog->functions[0]];
     qc_exec_stack_t st;
-    size_t  parampos;
-    int32_t p;
+    qcint_t *params;
+    qcint_t *parms;
+    size_t   p;
 
     /* back up locals */
-    st.localsp  = vec_size(prog->localstack);
-    st.stmt     = prog->statement;
-    st.function = func;
+    st.localsp     = vec_size(prog->localstack);
+    st.localsfirst = func->firstlocal;
+    st.stmt        = prog->statement;
+    st.function    = func;
+    st.profnode    = prog->profnode;
+
+    if (prog->xflags & VMXF_PROFILE)
+        st.profnode = prog_profile_enter(prog, func);
 
     if (prog->xflags & VMXF_TRACE) {
         const char *str = prog_getstring(prog, func->name);
@@ -488,21 +2518,46 @@ static qcint_t prog_enterfunction(qc_program_t *prog, prog_section_function_t *f
         }
     }
 #else
+    /* the function prog_exec starts with always gets a full backup */
+    if ((prog->xflags & VMXF_LAZYLOCALS) && vec_size(prog->stack))
+    {
+        st.localsfirst += info->savefirst;
+        if (info->savecount)
+            vec_append(prog->localstack, info->savecount, &prog->globals[0] + st.localsfirst);
+    }
+    else
     {
         qcint_t *globals = &prog->globals[0] + func->firstlocal;
         vec_append(prog->localstack, func->locals, globals);
     }
 #endif
 
-    /* copy parameters */
-    parampos = func->firstlocal;
-    for (p = 0; p < func->nargs; ++p)
-    {
-        size_t s;
-        for (s = 0; s < func->argsize[p]; ++s) {
-            prog->globals[parampos] = prog->globals[OFS_PARM0 + 3*p + s];
-            ++parampos;
-        }
+    /* copy parameters, see prog_plan_params */
+    params = &prog->globals[0] + func->firstlocal;
+    parms  = &prog->globals[0] + OFS_PARM0;
+    switch (info->params) {
+        case QCVM_PARAMS_NONE:
+            break;
+        case QCVM_PARAMS_S3:
+            params[2] = parms[6];
+            /* fall through */
+        case QCVM_PARAMS_S2:
+            params[1] = parms[3];
+            /* fall through */
+        case QCVM_PARAMS_S1:
+            params[0] = parms[0];
+            break;
+        case QCVM_PARAMS_V1:
+            params[0] = parms[0];
+            params[1] = parms[1];
+            params[2] = parms[2];
+            break;
+        default:
+            for (p = 0; p < info->paramruns; ++p) {
+                memcpy(params, parms + info->paramrun[p].from, info->paramrun[p].count * sizeof(*params));
+                params += info->paramrun[p].count;
+            }
+            break;
     }
 
     vec_push(prog->stack, st);
@@ -513,9 +2568,13 @@ static qcint_t prog_enterfunction(qc_program_t *prog, prog_section_function_t *f
 static qcint_t prog_leavefunction(qc_program_t *prog) {
     prog_section_function_t *prev = nullptr;
     size_t oldsp;
+    size_t first;
 
     qc_exec_stack_t st = vec_last(prog->stack);
 
+    if (prog->xflags & VMXF_PROFILE)
+        prog_profile_leave(prog, st.profnode);
+
     if (prog->xflags & VMXF_TRACE) {
         if (vec_size(prog->function_stack))
             vec_pop(prog->function_stack);
@@ -525,70 +2584,487 @@ static qcint_t prog_leavefunction(qc_program_t *prog) {
     if (vec_size(prog->stack) > 1) {
         prev  = prog->stack[vec_size(prog->stack)-2].function;
         oldsp = prog->stack[vec_size(prog->stack)-2].localsp;
+        first = prev->firstlocal;
     }
 #else
     prev  = prog->stack[vec_size(prog->stack)-1].function;
     oldsp = prog->stack[vec_size(prog->stack)-1].localsp;
+    first = prog->stack[vec_size(prog->stack)-1].localsfirst;
 #endif
     if (prev) {
-        qcint_t *globals = &prog->globals[0] + prev->firstlocal;
-        memcpy(globals, prog->localstack + oldsp, prev->locals * sizeof(prog->localstack[0]));
+        /* everything above oldsp was backed up by this frame */
+        qcint_t *globals = &prog->globals[0] + first;
+        memcpy(globals, prog->localstack + oldsp, (vec_size(prog->localstack) - oldsp) * sizeof(prog->localstack[0]));
         /* vec_remove(prog->localstack, oldsp, vec_size(prog->localstack)-oldsp); */
         vec_shrinkto(prog->localstack, oldsp);
     }
 
-    vec_pop(prog->stack);
+    vec_pop(prog->stack);
+
+    return st.stmt - 1; /* offset the ++st */
+}
+
+/* what prog_exec_budget keeps of the budget outside the loop */
+struct prog_budget_t {
+    uint64_t statements; /* the limit, 0 for none                 */
+    uint64_t charged;    /* statements charged before the last grant */
+    int64_t  granted;    /* statements the loop got with the last grant */
+    uint64_t nanoseconds;
+    uint64_t deadline;   /* on prog_profile_clock, 0 for none      */
+};
+
+/*
+ * The loop charges statements against `left`, and once it goes negative
+ * this checks the budget and grants the loop more statements.  Returns
+ * true with the error raised when the budget ran out.
+ */
+static bool prog_budget_expired(qc_program_t *prog, prog_budget_t *budget, int64_t *left) {
+    budget->charged += budget->granted - *left;
+
+    if (budget->statements && budget->charged > budget->statements) {
+        qcvmerror(prog, "`%s` ran out of its budget of %llu statements",
+                  prog->filename, (unsigned long long)budget->statements);
+        return true;
+    }
+    if (budget->deadline && prog_profile_clock() >= budget->deadline) {
+        qcvmerror(prog, "`%s` ran out of its budget of %.3f seconds",
+                  prog->filename, budget->nanoseconds / 1e9);
+        return true;
+    }
+
+    budget->granted = budget->statements ? (int64_t)(budget->statements - budget->charged) : INT64_MAX;
+    if (budget->deadline && budget->granted > VM_BUDGET_CLOCK_STATEMENTS)
+        budget->granted = VM_BUDGET_CLOCK_STATEMENTS;
+    *left = budget->granted;
+    return false;
+}
+
+/*
+ * Keeps the QC stack in prog->errortrace, innermost function first.  st
+ * is the statement which failed, the frames above oldstack are the ones
+ * this prog_exec entered.
+ */
+static void prog_error_trace(qc_program_t *prog, const qc_exec_statement_t *st, size_t oldstack) {
+    char   line[1024];
+    size_t stmt = st - prog->decoded;
+    size_t i;
+
+    vec_free(prog->errortrace);
+    for (i = vec_size(prog->stack); i-- > oldstack; ) {
+        const prog_section_function_t *func = prog->stack[i].function;
+        int len;
+        if (prog->linenums && stmt < prog->code.size())
+            len = util_snprintf(line, sizeof(line), "    at %s (%s:%d)\n",
+                                prog_getstring(prog, func->name),
+                                prog_getstring(prog, func->file),
+                                (int)prog->linenums[stmt]);
+        else
+            len = util_snprintf(line, sizeof(line), "    at %s (statement %lu)\n",
+                                prog_getstring(prog, func->name), (unsigned long)stmt);
+        if (len < 0)
+            continue;
+        if ((size_t)len >= sizeof(line))
+            len = sizeof(line) - 1;
+        vec_append(prog->errortrace, (size_t)len, line);
+        /* the caller continues after the call */
+        stmt = prog->stack[i].stmt - 1;
+    }
+    vec_push(prog->errortrace, 0);
+}
+
+bool prog_exec(qc_program_t *prog, prog_section_function_t *func, size_t flags, long maxjumps) {
+    qc_exec_budget_t budget;
+    budget.jumps       = maxjumps;
+    budget.gotos       = VM_GOTOS_DEFAULT;
+    budget.statements  = 0;
+    budget.nanoseconds = 0;
+    return prog_exec_budget(prog, func, flags, &budget);
+}
+
+/*
+ * Runs func.  When the budget runs out, or on any other error, the
+ * program is left as it was before the call, apart from the globals and
+ * entities it changed, and prog->errortrace tells where it stopped.
+ */
+bool prog_exec_budget(qc_program_t *prog, prog_section_function_t *func, size_t flags, const qc_exec_budget_t *limits) {
+    long jumpsleft = limits->jumps > 0 ? limits->jumps : LONG_MAX;
+    long gotosleft = limits->gotos > 0 ? limits->gotos : LONG_MAX;
+    prog_budget_t budget;
+    int64_t left;
+    qc_exec_statement_t *mark; /* where the statements not charged yet start */
+    size_t oldxflags = prog->xflags;
+    size_t loop;
+    size_t oldstack  = vec_size(prog->stack);
+    size_t oldlocals = vec_size(prog->localstack);
+    size_t oldfuncs  = vec_size(prog->function_stack);
+    size_t oldnode   = prog->profnode;
+    qc_exec_statement_t *st;
+
+    /* builtins calling back into the program are not covered by prog_analyze_locals */
+    if (vec_size(prog->stack))
+        flags &= ~VMXF_LAZYLOCALS;
+
+    prog->vmerror = 0;
+    prog->xflags = flags;
+    loop = flags;
+
+    /* tracing, logging and profiling need the per-statement hooks of the switch loop */
+    if (prog->tracelog)
+        loop |= VMXF_TRACE;
+    if (loop & (VMXF_TRACE|VMXF_PROFILE))
+        loop &= ~VMXF_THREADED;
+
+    budget.statements  = limits->statements;
+    budget.charged     = 0;
+    budget.granted     = 0;
+    budget.nanoseconds = limits->nanoseconds;
+    budget.deadline    = limits->nanoseconds ? prog_profile_clock() + limits->nanoseconds : 0;
+    left = 0;
+    prog_budget_expired(prog, &budget, &left);
+
+    st = prog->decoded + prog_enterfunction(prog, func);
+    if (prog->tracelog)
+        prog_tracelog_enter(prog, func);
+    mark = st;
+    --st;
+    switch (loop & (VMXF_TRACE|VMXF_PROFILE|VMXF_THREADED))
+    {
+        default:
+        case 0:
+        {
+#define QCVM_LOOP     1
+#define QCVM_PROFILE  0
+#define QCVM_TRACE    0
+#define QCVM_THREADED 0
+#           include __FILE__
+        }
+        case (VMXF_TRACE):
+        {
+#define QCVM_PROFILE  0
+#define QCVM_TRACE    1
+#define QCVM_THREADED 0
+#           include __FILE__
+        }
+        case (VMXF_PROFILE):
+        {
+#define QCVM_PROFILE  1
+#define QCVM_TRACE    0
+#define QCVM_THREADED 0
+#           include __FILE__
+        }
+        case (VMXF_TRACE|VMXF_PROFILE):
+        {
+#define QCVM_PROFILE  1
+#define QCVM_TRACE    1
+#define QCVM_THREADED 0
+#           include __FILE__
+        }
+#if QCVM_HAVE_COMPUTED_GOTO
+        /* fall through - never taken, the loop above only leaves through cleanup */
+        case (VMXF_THREADED):
+        {
+#define QCVM_PROFILE  0
+#define QCVM_TRACE    0
+#define QCVM_THREADED 1
+#           include __FILE__
+        }
+#endif
+    };
+
+cleanup:
+    if (prog->vmerror)
+        prog_error_trace(prog, st, oldstack);
+
+    /*
+     * the stacks are kept for the next call, this only matters when an
+     * error left frames behind
+     */
+    prog->xflags = oldxflags;
+    if (prog->localstack)     vec_shrinkto(prog->localstack,     oldlocals);
+    if (prog->stack)          vec_shrinkto(prog->stack,          oldstack);
+    if (prog->function_stack) vec_shrinkto(prog->function_stack, oldfuncs);
+    prog->profnode = oldnode;
+    if (prog->vmerror)
+        return false;
+    return true;
+}
+
+/***********************************************************************
+ * Profiling reports
+ */
+
+/*
+ * Reads the line numbers of a .lno file written next to the progs by
+ * -flno.  The counts in its header have to match the loaded program.
+ */
+bool prog_load_lno(qc_program_t *prog, const char *filename) {
+    char     magic[4];
+    uint32_t header[5]; /* version, defs, globals, fields, statements */
+    FILE    *file = fopen(filename, "rb");
+
+    if (!file)
+        return false;
+
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+        fread(header, sizeof(header), 1, file) != 1)
+    {
+        loaderror("failed to read header from '%s'", filename);
+        fclose(file);
+        return false;
+    }
+    util_endianswap(header, 5, sizeof(header[0]));
+
+    if (memcmp(magic, "LNOF", 4) || header[0] != 1 ||
+        header[1] != prog->defs.size()        ||
+        header[2] != prog->globals.size() - 2 ||
+        header[3] != prog->fields.size()      ||
+        header[4] != prog->code.size())
+    {
+        fprintf(stderr, "'%s' does not belong to '%s'\n", filename, prog->filename);
+        fclose(file);
+        return false;
+    }
+
+    vec_free(prog->linenums);
+    if (fread(vec_add(prog->linenums, header[4]), sizeof(int32_t), header[4], file) != header[4]) {
+        loaderror("failed to read line numbers from '%s'", filename);
+        vec_free(prog->linenums);
+        fclose(file);
+        return false;
+    }
+    util_endianswap(prog->linenums, header[4], sizeof(int32_t));
+
+    fclose(file);
+    return true;
+}
+
+struct prog_profile_entry_t {
+    qcint_t  function;
+    size_t   calls;
+    size_t   self;
+    size_t   total;
+    uint64_t selftime;
+    uint64_t totaltime;
+};
+
+static int prog_profile_cmp(const void *a, const void *b) {
+    const prog_profile_entry_t *x = (const prog_profile_entry_t*)a;
+    const prog_profile_entry_t *y = (const prog_profile_entry_t*)b;
+    if (x->self != y->self)
+        return x->self > y->self ? -1 : 1;
+    if (x->selftime != y->selftime)
+        return x->selftime > y->selftime ? -1 : 1;
+    return x->function - y->function;
+}
+
+/* the same order without the times, so it is the same on every run */
+static int prog_profile_count_cmp(const void *a, const void *b) {
+    const prog_profile_entry_t *x = (const prog_profile_entry_t*)a;
+    const prog_profile_entry_t *y = (const prog_profile_entry_t*)b;
+    if (x->self != y->self)
+        return x->self > y->self ? -1 : 1;
+    return x->function - y->function;
+}
+
+struct prog_profile_line_t {
+    qcint_t function;
+    int32_t line;
+    size_t  count;
+};
+
+static int prog_profile_line_cmp(const void *a, const void *b) {
+    const prog_profile_line_t *x = (const prog_profile_line_t*)a;
+    const prog_profile_line_t *y = (const prog_profile_line_t*)b;
+    if (x->function != y->function)
+        return x->function - y->function;
+    return x->line - y->line;
+}
+
+static int prog_profile_hot_cmp(const void *a, const void *b) {
+    const prog_profile_line_t *x = (const prog_profile_line_t*)a;
+    const prog_profile_line_t *y = (const prog_profile_line_t*)b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return prog_profile_line_cmp(a, b);
+}
+
+static int prog_entry_cmp(const void *a, const void *b) {
+    const qcint_t *x = (const qcint_t*)a;
+    const qcint_t *y = (const qcint_t*)b;
+    return x[0] - y[0];
+}
+
+/* how many of the hottest lines prog_profile_report lists */
+#define PROG_PROFILE_LINES 20
+
+static void prog_profile_lines(qc_program_t *prog, FILE *out) {
+    qcint_t             *entries = nullptr; /* pairs of entry and function */
+    prog_profile_line_t *lines   = nullptr;
+    size_t               merged  = 0;
+    size_t               i, k;
+
+    for (i = 1; i < prog->functions.size(); ++i) {
+        if (prog->functions[i].entry < 0)
+            continue;
+        vec_push(entries, prog->functions[i].entry);
+        vec_push(entries, (qcint_t)i);
+    }
+    qsort(entries, vec_size(entries) / 2, 2 * sizeof(*entries), &prog_entry_cmp);
+
+    /* a function's statements run up to the entry of the next one */
+    for (i = 0; i < vec_size(entries); i += 2) {
+        size_t end = (i + 2 < vec_size(entries)) ? (size_t)entries[i + 2] : prog->code.size();
+        for (k = entries[i]; k < end; ++k) {
+            prog_profile_line_t line;
+            if (!prog->profile[k])
+                continue;
+            line.function = entries[i + 1];
+            line.line     = prog->linenums[k];
+            line.count    = prog->profile[k];
+            vec_push(lines, line);
+        }
+    }
+
+    if (vec_size(lines)) {
+        qsort(lines, vec_size(lines), sizeof(*lines), &prog_profile_line_cmp);
+        for (i = 1; i < vec_size(lines); ++i) {
+            if (lines[i].function == lines[merged].function && lines[i].line == lines[merged].line)
+                lines[merged].count += lines[i].count;
+            else
+                lines[++merged] = lines[i];
+        }
+        vec_shrinkto(lines, merged + 1);
+        qsort(lines, vec_size(lines), sizeof(*lines), &prog_profile_hot_cmp);
+    }
+
+    fprintf(out, "\n%12s  %s\n", "statements", "line");
+    for (i = 0; i < vec_size(lines) && i < PROG_PROFILE_LINES; ++i) {
+        prog_section_function_t *func = &prog->functions[lines[i].function];
+        fprintf(out, "%12lu  %s:%d (%s)\n",
+                (unsigned long)lines[i].count,
+                prog_getstring(prog, func->file),
+                (int)lines[i].line,
+                prog_getstring(prog, func->name));
+    }
+
+    vec_free(entries);
+    vec_free(lines);
+}
+
+/*
+ * Prints the calls, statements and time of every function which ran,
+ * self being what ran in the function itself and total including what it
+ * called.  For recursive functions the total only counts the outermost
+ * call.  With line numbers loaded the hottest lines follow.  Without
+ * times only the counts are printed, which don't change between runs.
+ */
+void prog_profile_report(qc_program_t *prog, FILE *out, bool times) {
+    size_t                count = vec_size(prog->profnodes);
+    size_t               *total = nullptr;
+    uint64_t             *inner = nullptr; /* time spent in the children */
+    prog_profile_entry_t *funcs = nullptr;
+    size_t                calls = 0;
+    size_t                i;
+
+    if (!count) {
+        fprintf(out, "no profile was recorded\n");
+        return;
+    }
+
+    memset(vec_add(total, count), 0, count * sizeof(*total));
+    memset(vec_add(inner, count), 0, count * sizeof(*inner));
+    for (i = count; --i > 0; ) {
+        const qc_exec_profnode_t *node = &prog->profnodes[i];
+        total[i]            += node->self;
+        total[node->parent] += total[i];
+        inner[node->parent] += node->time;
+    }
 
-    return st.stmt - 1; /* offset the ++st */
-}
+    memset(vec_add(funcs, prog->functions.size()), 0, prog->functions.size() * sizeof(*funcs));
+    for (i = 0; i < prog->functions.size(); ++i)
+        funcs[i].function = (qcint_t)i;
 
-bool prog_exec(qc_program_t *prog, prog_section_function_t *func, size_t flags, long maxjumps) {
-    long jumpcount = 0;
-    size_t oldxflags = prog->xflags;
-    prog_section_statement_t *st;
+    for (i = 1; i < count; ++i) {
+        const qc_exec_profnode_t *node = &prog->profnodes[i];
+        prog_profile_entry_t     *func = &funcs[node->function];
+        size_t                    up;
 
-    prog->vmerror = 0;
-    prog->xflags = flags;
+        func->calls    += node->calls;
+        func->self     += node->self;
+        func->selftime += node->time - inner[i];
+        calls          += node->calls;
 
-    st = &prog->code[0] + prog_enterfunction(prog, func);
-    --st;
-    switch (flags)
-    {
-        default:
-        case 0:
-        {
-#define QCVM_LOOP    1
-#define QCVM_PROFILE 0
-#define QCVM_TRACE   0
-#           include __FILE__
-        }
-        case (VMXF_TRACE):
-        {
-#define QCVM_PROFILE 0
-#define QCVM_TRACE   1
-#           include __FILE__
+        for (up = node->parent; up; up = prog->profnodes[up].parent) {
+            if (prog->profnodes[up].function == node->function)
+                break;
         }
-        case (VMXF_PROFILE):
-        {
-#define QCVM_PROFILE 1
-#define QCVM_TRACE   0
-#           include __FILE__
+        if (!up) {
+            func->total     += total[i];
+            func->totaltime += node->time;
         }
-        case (VMXF_TRACE|VMXF_PROFILE):
-        {
-#define QCVM_PROFILE 1
-#define QCVM_TRACE   1
-#           include __FILE__
+    }
+    qsort(funcs, vec_size(funcs), sizeof(*funcs), times ? &prog_profile_cmp : &prog_profile_count_cmp);
+
+    fprintf(out, "profile: %lu statements, %lu calls\n", (unsigned long)total[0], (unsigned long)calls);
+    if (times)
+        fprintf(out, "%10s %12s %12s %10s %10s  %s\n",
+                "calls", "self", "total", "self ms", "total ms", "function");
+    else
+        fprintf(out, "%10s %12s %12s  %s\n", "calls", "self", "total", "function");
+    for (i = 0; i < vec_size(funcs); ++i) {
+        prog_section_function_t *func = &prog->functions[funcs[i].function];
+        if (!funcs[i].calls)
+            continue;
+        fprintf(out, "%10lu %12lu %12lu ",
+                (unsigned long)funcs[i].calls,
+                (unsigned long)funcs[i].self,
+                (unsigned long)funcs[i].total);
+        if (times)
+            fprintf(out, "%10.3f %10.3f ", funcs[i].selftime / 1e6, funcs[i].totaltime / 1e6);
+        fprintf(out, " %s", prog_getstring(prog, func->name));
+        if (func->entry < 0)
+            fprintf(out, " (builtin #%d)\n", (int)-func->entry);
+        else if (prog->linenums)
+            fprintf(out, " (%s:%d)\n", prog_getstring(prog, func->file), (int)prog->linenums[func->entry]);
+        else
+            fprintf(out, " (%s)\n", prog_getstring(prog, func->file));
+    }
+
+    if (prog->linenums)
+        prog_profile_lines(prog, out);
+
+    vec_free(total);
+    vec_free(inner);
+    vec_free(funcs);
+}
+
+/*
+ * Writes the call paths in the collapsed stack format flame graph tools
+ * read, one line per path weighted by the statements executed on it.
+ */
+void prog_profile_flamegraph(qc_program_t *prog, FILE *out) {
+    size_t *path = nullptr;
+    size_t  i, k;
+
+    for (i = 1; i < vec_size(prog->profnodes); ++i) {
+        size_t up;
+        if (!prog->profnodes[i].self)
+            continue;
+
+        if (path)
+            vec_shrinkto(path, 0);
+        for (up = i; up; up = prog->profnodes[up].parent)
+            vec_push(path, up);
+
+        for (k = vec_size(path); k-- > 0; ) {
+            fprintf(out, "%s%s",
+                    prog_getstring(prog, prog->functions[prog->profnodes[path[k]].function].name),
+                    k ? ";" : "");
         }
-    };
+        fprintf(out, " %lu\n", (unsigned long)prog->profnodes[i].self);
+    }
 
-cleanup:
-    prog->xflags = oldxflags;
-    vec_free(prog->localstack);
-    vec_free(prog->stack);
-    if (prog->vmerror)
-        return false;
-    return true;
+    vec_free(path);
 }
 
 /***********************************************************************
@@ -597,12 +3073,21 @@ cleanup:
 
 #include <math.h>
 
+#include <atomic>
+#include <thread>
+#include <vector>
+
 struct qcvm_parameter {
     int         vtype;
     const char *value;
 };
 
-static qcvm_parameter *main_params = nullptr;
+/* qcvm's own state for its builtins, kept in qc_program_t::userdata */
+struct qcvm_state {
+    bool  quiet;   /* print nothing, set while benchmarking          */
+    bool  capture; /* print into output instead of stdout, for -batch */
+    char *output;
+};
 
 #define CheckArgs(num) do {                                                    \
     if (prog->argc != (num)) {                                                 \
@@ -620,10 +3105,16 @@ static qcvm_parameter *main_params = nullptr;
 static int qc_print(qc_program_t *prog) {
     size_t i;
     const char *laststr = nullptr;
+    qcvm_state *state = (qcvm_state*)prog->userdata;
+    if (state->quiet)
+        return 0;
     for (i = 0; i < (size_t)prog->argc; ++i) {
         qcany_t *str = (qcany_t*)(&prog->globals[0] + OFS_PARM0 + 3*i);
         laststr = prog_getstring(prog, str->string);
-        printf("%s", laststr);
+        if (state->capture)
+            vec_append(state->output, strlen(laststr), laststr);
+        else
+            printf("%s", laststr);
     }
     if (laststr && (prog->xflags & VMXF_TRACE)) {
         size_t len = strlen(laststr);
@@ -743,6 +3234,7 @@ static int qc_normalize(qc_program_t *prog) {
 }
 
 static int qc_strcat(qc_program_t *prog) {
+    char   local[512];
     char  *buffer;
     size_t len1,   len2;
     qcany_t *str1,  *str2;
@@ -758,11 +3250,16 @@ static int qc_strcat(qc_program_t *prog) {
     cstr2 = prog_getstring(prog, str2->string);
     len1 = strlen(cstr1);
     len2 = strlen(cstr2);
-    buffer = (char*)mem_a(len1 + len2 + 1);
+    /*
+     * the result has to be put together outside the ring, writing it may
+     * overwrite the operands
+     */
+    buffer = (len1 + len2 + 1 <= sizeof(local)) ? local : (char*)mem_a(len1 + len2 + 1);
     memcpy(buffer, cstr1, len1);
     memcpy(buffer+len1, cstr2, len2+1);
     out.string = prog_tempstring(prog, buffer);
-    mem_d(buffer);
+    if (buffer != local)
+        mem_d(buffer);
     Return(out);
     return 0;
 }
@@ -811,23 +3308,22 @@ static int qc_pow(qc_program_t *prog) {
     return 0;
 }
 
-static prog_builtin_t qc_builtins[] = {
-    nullptr,
-    &qc_print,       /*   1   */
-    &qc_ftos,        /*   2   */
-    &qc_spawn,       /*   3   */
-    &qc_kill,        /*   4   */
-    &qc_vtos,        /*   5   */
-    &qc_error,       /*   6   */
-    &qc_vlen,        /*   7   */
-    &qc_etos,        /*   8   */
-    &qc_stof,        /*   9   */
-    &qc_strcat,      /*   10  */
-    &qc_strcmp,      /*   11  */
-    &qc_normalize,   /*   12  */
-    &qc_sqrt,        /*   13  */
-    &qc_floor,       /*   14  */
-    &qc_pow          /*   15  */
+static const prog_builtin_def_t qc_builtins[] = {
+    { "print",     1,  &qc_print     },
+    { "ftos",      2,  &qc_ftos      },
+    { "spawn",     3,  &qc_spawn     },
+    { "kill",      4,  &qc_kill      },
+    { "vtos",      5,  &qc_vtos      },
+    { "error",     6,  &qc_error     },
+    { "vlen",      7,  &qc_vlen      },
+    { "etos",      8,  &qc_etos      },
+    { "stof",      9,  &qc_stof      },
+    { "strcat",    10, &qc_strcat    },
+    { "strcmp",    11, &qc_strcmp    },
+    { "normalize", 12, &qc_normalize },
+    { "sqrt",      13, &qc_sqrt      },
+    { "floor",     14, &qc_floor     },
+    { "pow",       15, &qc_pow       }
 };
 
 static const char *arg0 = nullptr;
@@ -847,7 +3343,27 @@ static void usage(void) {
     printf("options:\n");
     printf("  -h, --help         print this message\n"
            "  -trace             trace the execution\n"
-           "  -profile           perform profiling during execution\n"
+           "  -profile           profile the execution, the report goes to stderr\n"
+           "  -profile-counts    profile, the report goes to stdout without times\n"
+           "  -flamegraph file   profile and write collapsed stacks to file, - for stdout\n"
+           "  -bench runs        time this many runs and print a JSON report\n"
+           "  -warmup runs       untimed runs before -bench, default 1\n"
+           "  -func name         the function to execute instead of main\n"
+           "  -batch file        run the jobs listed in file in parallel\n"
+           "  -jobs n            threads for -batch, default one per CPU\n"
+           "  -record file       log the statements and builtin calls to file\n"
+           "  -replay file       run again as logged by -record, stop where it differs\n"
+           "  -snapshot          run, snapshot, run, restore the snapshot and run again\n"
+           "  -reload file       run, reload the program from file and run the new one\n"
+           "  -maxjumps n        stop after n backward IF/IFNOT jumps, 0 for no limit\n"
+           "  -maxgotos n        stop after n backward GOTOs, 0 for no limit\n"
+           "  -maxstatements n   stop after about n statements\n"
+           "  -maxtime ms        stop after ms milliseconds\n"
+           "  -threaded          use threaded (computed goto) dispatch\n"
+           "  -lazylocals        only back up locals which callers still use\n"
+           "  -entreuse order    reuse freed entities: lowest, lifo or fifo\n"
+           "  -entcolumns        store entity fields column by column\n"
+           "  -mmap              map the program instead of reading it\n"
            "  -info              print information from the prog's header\n"
            "  -disasm            disassemble and exit\n"
            "  -disasm-func func  disassemble and exit\n"
@@ -862,7 +3378,7 @@ static void usage(void) {
            "  -string <s>   pass a string parameter to main() \n");
 }
 
-static void prog_main_setparams(qc_program_t *prog) {
+static void prog_main_setparams(qc_program_t *prog, const qcvm_parameter *main_params) {
     size_t i;
     qcany_t *arg;
 
@@ -893,11 +3409,452 @@ static void prog_main_setparams(qc_program_t *prog) {
 
 static void prog_disasm_function(qc_program_t *prog, size_t id);
 
+/*
+ * The line numbers are picked up from the .lno file -flno writes next to
+ * the progs.  With counts the report goes to stdout without the times,
+ * a flame graph written to "-" goes there too.
+ */
+static void prog_main_profile(qc_program_t *prog, const char *flamegraph, bool counts) {
+    char  *lnofile = nullptr;
+    char  *dot;
+    size_t len = strlen(prog->filename);
+    FILE  *file;
+
+    memcpy(vec_add(lnofile, len + 1), prog->filename, len + 1);
+    dot = strrchr(lnofile, '.');
+    if (!dot || strchr(dot, '/'))
+        vec_pop(lnofile);
+    else
+        vec_shrinkto(lnofile, dot - lnofile);
+    memcpy(vec_add(lnofile, 5), ".lno", 5);
+    prog_load_lno(prog, lnofile);
+    vec_free(lnofile);
+
+    if (counts)
+        prog_profile_report(prog, stdout, false);
+    else
+        prog_profile_report(prog, stderr, true);
+
+    if (flamegraph && !strcmp(flamegraph, "-"))
+        prog_profile_flamegraph(prog, stdout);
+    else if (flamegraph) {
+        if (!(file = fopen(flamegraph, "w"))) {
+            fprintf(stderr, "failed to open '%s' for writing\n", flamegraph);
+            return;
+        }
+        prog_profile_flamegraph(prog, file);
+        fclose(file);
+    }
+}
+
+static void prog_bench_string(const char *str) {
+    putchar('"');
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            printf("\\u%04x", (unsigned char)*str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+/*
+ * Times `runs` runs of the function after `warmup` untimed ones and prints
+ * a JSON report.  Statements, calls and opcodes are counted in one more,
+ * profiled run, so counting doesn't slow down the timed ones.
+ */
+static bool prog_main_bench(qc_program_t *prog, qcint_t fn, const qcvm_parameter *params,
+                            size_t xflags, size_t runs, size_t warmup)
+{
+    static const struct {
+        size_t      flag;
+        const char *name;
+    } flagnames[] = {
+        { VMXF_THREADED,   "threaded"   },
+        { VMXF_LAZYLOCALS, "lazylocals" },
+        { VMXF_TRACE,      "trace"      },
+        { VMXF_PROFILE,    "profile"    }
+    };
+
+    qc_exec_stats_t stats;
+    size_t   opcodes[VINSTR_END];
+    size_t   statements = 0;
+    size_t   calls      = 0;
+    uint64_t total      = 0;
+    uint64_t fastest    = 0;
+    size_t   i;
+    bool     first;
+
+    for (i = 0; i < warmup; ++i) {
+        prog_main_setparams(prog, params);
+        if (!prog_exec(prog, &prog->functions[fn], xflags, VM_JUMPS_DEFAULT))
+            return false;
+    }
+
+    memset(&prog->stats, 0, sizeof(prog->stats));
+    for (i = 0; i < runs; ++i) {
+        uint64_t start, took;
+        prog_main_setparams(prog, params);
+        start = prog_profile_clock();
+        if (!prog_exec(prog, &prog->functions[fn], xflags, VM_JUMPS_DEFAULT))
+            return false;
+        took   = prog_profile_clock() - start;
+        total += took;
+        if (!i || took < fastest)
+            fastest = took;
+    }
+    stats = prog->stats;
+
+    memset(prog->profile, 0, prog->code.size() * sizeof(prog->profile[0]));
+    vec_free(prog->profnodes);
+    prog->profnode = 0;
+    prog_main_setparams(prog, params);
+    if (!prog_exec(prog, &prog->functions[fn], (xflags & VMXF_LAZYLOCALS) | VMXF_PROFILE, VM_JUMPS_DEFAULT))
+        return false;
+
+    memset(opcodes, 0, sizeof(opcodes));
+    for (i = 0; i < prog->code.size(); ++i) {
+        statements += prog->profile[i];
+        if (prog->code[i].opcode < VINSTR_END)
+            opcodes[prog->code[i].opcode] += prog->profile[i];
+    }
+    for (i = 1; i < vec_size(prog->profnodes); ++i)
+        calls += prog->profnodes[i].calls;
+
+    printf("{\n  \"program\": ");
+    prog_bench_string(prog->filename);
+    printf(",\n  \"function\": ");
+    prog_bench_string(prog_getstring(prog, prog->functions[fn].name));
+    printf(",\n  \"flags\": [");
+    for (first = true, i = 0; i < GMQCC_ARRAY_COUNT(flagnames); ++i) {
+        if (!(xflags & flagnames[i].flag))
+            continue;
+        printf("%s\"%s\"", first ? "" : ", ", flagnames[i].name);
+        first = false;
+    }
+    printf("],\n");
+    printf("  \"entcolumns\": %s,\n", prog->entitycolumns ? "true" : "false");
+    printf("  \"warmup\": %lu,\n", (unsigned long)warmup);
+    printf("  \"runs\": %lu,\n", (unsigned long)runs);
+    printf("  \"seconds\": %.9f,\n", total / 1e9);
+    printf("  \"fastest_run_seconds\": %.9f,\n", fastest / 1e9);
+    printf("  \"statements_per_run\": %lu,\n", (unsigned long)statements);
+    printf("  \"calls_per_run\": %lu,\n", (unsigned long)calls);
+    printf("  \"statements_per_second\": %.1f,\n", total ? statements * runs / (total / 1e9) : 0.0);
+    printf("  \"calls_per_second\": %.1f,\n", total ? calls * runs / (total / 1e9) : 0.0);
+    printf("  \"nanoseconds_per_statement\": %.3f,\n", statements ? (double)total / (statements * runs) : 0.0);
+    printf("  \"opcodes\": {");
+    for (first = true, i = 0; i < VINSTR_END; ++i) {
+        if (!opcodes[i])
+            continue;
+        printf("%s\n    \"%s\": %lu", first ? "" : ",", util_instr_str[i], (unsigned long)opcodes[i]);
+        first = false;
+    }
+    printf("%s},\n", first ? "" : "\n  ");
+    printf("  \"allocations\": {\n");
+    printf("    \"entities_spawned\": %lu,\n", (unsigned long)stats.spawned);
+    printf("    \"entities_reused\": %lu,\n",  (unsigned long)stats.reused);
+    printf("    \"entities_freed\": %lu,\n",   (unsigned long)stats.freed);
+    printf("    \"entity_growths\": %lu,\n",   (unsigned long)stats.entitygrowths);
+    printf("    \"entity_capacity\": %lu,\n",  (unsigned long)prog->entitycapacity);
+    printf("    \"tempstrings\": %lu,\n",      (unsigned long)stats.tempstrings);
+    printf("    \"tempstring_bytes\": %lu,\n", (unsigned long)stats.tempbytes);
+    printf("    \"tempstring_wraps\": %lu\n",  (unsigned long)stats.tempwraps);
+    printf("  }\n}\n");
+    return true;
+}
+
+/*
+ * Runs the function, takes a snapshot, runs it again, puts the snapshot
+ * back and runs it a third time, which has to do what the second run
+ * did.  Stops at the first run which fails.
+ */
+static bool prog_main_snapshot(qc_program_t *prog, qcint_t fn, const qcvm_parameter *params,
+                               size_t xflags, const qc_exec_budget_t *budget)
+{
+    qc_snapshot_t *snap;
+    bool           ok;
+
+    prog_main_setparams(prog, params);
+    if (!prog_exec_budget(prog, &prog->functions[fn], xflags, budget))
+        return true;
+
+    snap = prog_snapshot(prog);
+    prog_main_setparams(prog, params);
+    if (!prog_exec_budget(prog, &prog->functions[fn], xflags, budget)) {
+        prog_snapshot_delete(snap);
+        return true;
+    }
+
+    ok = prog_restore(prog, snap);
+    prog_snapshot_delete(snap);
+    if (!ok)
+        return false;
+    prog_main_setparams(prog, params);
+    prog_exec_budget(prog, &prog->functions[fn], xflags, budget);
+    return true;
+}
+
+static qcint_t prog_main_findfunction(qc_program_t *prog, const char *name) {
+    prog_section_function_t *func = prog_find_function(prog, name);
+    if (!func || func == &prog->functions[0])
+        return -1;
+    return (qcint_t)(func - &prog->functions[0]);
+}
+
+/*
+ * Runs the function, loads filename as the new version of the program
+ * with prog_reload and runs the function called fnname in it.  Returns
+ * the new program, prog is left to the caller.
+ */
+static qc_program_t *prog_main_reload(qc_program_t *prog, qcint_t fn, const char *fnname,
+                                      const char *filename, size_t lflags, const qcvm_parameter *params,
+                                      size_t xflags, const qc_exec_budget_t *budget)
+{
+    qc_program_t *np;
+
+    prog_main_setparams(prog, params);
+    prog_exec_budget(prog, &prog->functions[fn], xflags, budget);
+
+    if (!(np = prog_reload(prog, filename, lflags))) {
+        fprintf(stderr, "failed to reload '%s'\n", filename);
+        return nullptr;
+    }
+    if ((fn = prog_main_findfunction(np, fnname)) > 0) {
+        prog_main_setparams(np, params);
+        prog_exec_budget(np, &np->functions[fn], xflags, budget);
+    } else
+        fprintf(stderr, "No %s function found in '%s'\n", fnname, filename);
+    return np;
+}
+
+struct qcvm_job {
+    char           *line;   /* the words of the job, the parameters point in here */
+    size_t          lineno;
+    qcint_t         fn;
+    qcvm_parameter *params;
+    char           *output;
+    bool            failed;
+    char           *trace;  /* prog->errortrace when it failed */
+};
+
+struct qcvm_batch {
+    qc_program_t        *prog;
+    qcvm_job            *jobs;
+    size_t               xflags;
+    qc_exec_budget_t     budget;
+    std::atomic<size_t>  next;
+};
+
+/*
+ * Cuts the next word out of a batch line.  Words are separated by spaces,
+ * double quotes group spaces into a word and a backslash takes the next
+ * character as it is.  The word is unquoted in place.
+ */
+static char *prog_batch_word(char **at) {
+    char *in  = *at;
+    char *out;
+    char *word;
+    bool  quoted = false;
+
+    while (util_isspace(*in))
+        ++in;
+    if (!*in)
+        return nullptr;
+
+    word = out = in;
+    for (; *in && (quoted || !util_isspace(*in)); ++in) {
+        if (*in == '"')
+            quoted = !quoted;
+        else if (*in == '\\' && in[1])
+            *out++ = *++in;
+        else
+            *out++ = *in;
+    }
+    if (*in)
+        ++in;
+    *out = 0;
+    *at  = in;
+    return word;
+}
+
+/*
+ * A batch file has one job per line: -func name and the -float, -vector
+ * and -string parameters, like on the command line.  Empty lines and
+ * lines starting with # are skipped.
+ */
+static bool prog_batch_read(qc_program_t *prog, const char *filename, qcint_t fn, qcvm_job **out) {
+    qcvm_job *jobs   = nullptr;
+    char     *line   = nullptr;
+    size_t    i;
+    size_t    size   = 0;
+    size_t    lineno = 0;
+    FILE     *file   = fopen(filename, "r");
+
+    if (!file) {
+        fprintf(stderr, "failed to open batch file '%s'\n", filename);
+        return false;
+    }
+
+    while (util_getline(&line, &size, file) != EOF) {
+        qcvm_job  job;
+        char     *at;
+        char     *word;
+        char     *start = line;
+
+        ++lineno;
+        while (util_isspace(*start))
+            ++start;
+        if (!*start || *start == '#')
+            continue;
+
+        memset(&job, 0, sizeof(job));
+        job.line   = util_strdup(start);
+        job.lineno = lineno;
+        job.fn     = fn;
+        vec_push(jobs, job);
+
+        at = vec_last(jobs).line;
+        while ((word = prog_batch_word(&at))) {
+            qcvm_parameter p;
+            char *value = prog_batch_word(&at);
+
+            if (!value) {
+                fprintf(stderr, "%s:%lu: missing value for %s\n", filename, (unsigned long)lineno, word);
+                goto error;
+            }
+            if (!strcmp(word, "-func")) {
+                vec_last(jobs).fn = prog_main_findfunction(prog, value);
+                if (vec_last(jobs).fn <= 0) {
+                    fprintf(stderr, "%s:%lu: no %s function found\n", filename, (unsigned long)lineno, value);
+                    goto error;
+                }
+                continue;
+            }
+            if (!strcmp(word, "-float"))
+                p.vtype = TYPE_FLOAT;
+            else if (!strcmp(word, "-vector"))
+                p.vtype = TYPE_VECTOR;
+            else if (!strcmp(word, "-string"))
+                p.vtype = TYPE_STRING;
+            else {
+                fprintf(stderr, "%s:%lu: unknown parameter: %s\n", filename, (unsigned long)lineno, word);
+                goto error;
+            }
+            p.value = value;
+            vec_push(vec_last(jobs).params, p);
+        }
+        if (vec_last(jobs).fn <= 0) {
+            fprintf(stderr, "%s:%lu: no function to execute\n", filename, (unsigned long)lineno);
+            goto error;
+        }
+    }
+
+    mem_d(line);
+    fclose(file);
+    *out = jobs;
+    return true;
+
+error:
+    for (i = 0; i < vec_size(jobs); ++i) {
+        mem_d(jobs[i].line);
+        vec_free(jobs[i].params);
+    }
+    vec_free(jobs);
+    mem_d(line);
+    fclose(file);
+    return false;
+}
+
+/*
+ * Every thread runs the jobs on its own clone of the program, which is
+ * reset to the loaded state before each job.
+ */
+static void prog_batch_worker(qcvm_batch *batch) {
+    qc_program_t *clone = prog_clone(batch->prog);
+    qcvm_state    state;
+    size_t        i;
+
+    if (!clone) {
+        while ((i = batch->next++) < vec_size(batch->jobs)) {
+            batch->jobs[i].failed = true;
+            batch->jobs[i].trace  = util_strdup("failed to clone the program\n");
+        }
+        return;
+    }
+
+    state.quiet     = false;
+    state.capture   = true;
+    state.output    = nullptr;
+    clone->userdata = &state;
+
+    while ((i = batch->next++) < vec_size(batch->jobs)) {
+        qcvm_job *job = &batch->jobs[i];
+        prog_copy_state(clone, batch->prog);
+        prog_main_setparams(clone, job->params);
+        job->failed = !prog_exec_budget(clone, &clone->functions[job->fn], batch->xflags, &batch->budget);
+        if (job->failed)
+            job->trace = util_strdup(clone->errortrace);
+        job->output = state.output;
+        state.output = nullptr;
+    }
+
+    prog_delete(clone);
+}
+
+/*
+ * Runs the jobs of a batch file on `threads` threads and prints what
+ * each of them printed in the order of the file.
+ */
+static bool prog_main_batch(qc_program_t *prog, const char *filename, qcint_t fn,
+                            size_t xflags, const qc_exec_budget_t *budget, size_t threads)
+{
+    std::vector<std::thread> workers;
+    qcvm_batch batch;
+    size_t     failed = 0;
+    size_t     i;
+
+    batch.prog   = prog;
+    batch.xflags = xflags;
+    batch.budget = *budget;
+    batch.next   = 0;
+    batch.jobs   = nullptr;
+    if (!prog_batch_read(prog, filename, fn, &batch.jobs))
+        return false;
+
+    if (threads > vec_size(batch.jobs))
+        threads = vec_size(batch.jobs);
+    for (i = 0; i < threads; ++i)
+        workers.emplace_back(prog_batch_worker, &batch);
+    for (auto &it : workers)
+        it.join();
+
+    for (i = 0; i < vec_size(batch.jobs); ++i) {
+        qcvm_job *job = &batch.jobs[i];
+        if (job->output)
+            fwrite(job->output, 1, vec_size(job->output), stdout);
+        if (job->failed) {
+            fprintf(stderr, "%s:%lu: job failed\n%s", filename, (unsigned long)job->lineno,
+                    job->trace ? job->trace : "");
+            ++failed;
+        }
+        mem_d(job->trace);
+        mem_d(job->line);
+        vec_free(job->params);
+        vec_free(job->output);
+    }
+    vec_free(batch.jobs);
+    return !failed;
+}
+
 int main(int argc, char **argv) {
     size_t      i;
     qcint_t       fnmain = -1;
     qc_program_t *prog;
     size_t      xflags = VMXF_DEFAULT;
+    size_t      lflags = VMLF_DEFAULT;
     bool        opts_printfields = false;
     bool        opts_printdefs   = false;
     bool        opts_printfuns   = false;
@@ -907,9 +3864,29 @@ int main(int argc, char **argv) {
     const char *progsfile        = nullptr;
     const char **dis_list        = nullptr;
     int         opts_v           = 0;
+    int         opts_entreuse    = VMENT_REUSE_LOWEST;
+    qcvm_parameter *main_params  = nullptr;
+    const char *flamegraph       = nullptr;
+    bool        profilecounts    = false;
+    const char *fnname           = "main";
+    size_t      benchruns        = 0;
+    size_t      warmupruns       = 1;
+    const char *batchfile        = nullptr;
+    const char *recordfile       = nullptr;
+    const char *replayfile       = nullptr;
+    bool        snapshot         = false;
+    const char *reloadfile       = nullptr;
+    qc_exec_budget_t budget;
+    size_t      batchjobs        = std::thread::hardware_concurrency();
+    qcvm_state  state;
 
     arg0 = argv[0];
 
+    budget.jumps       = VM_JUMPS_DEFAULT;
+    budget.gotos       = VM_GOTOS_DEFAULT;
+    budget.statements  = 0;
+    budget.nanoseconds = 0;
+
     if (argc < 2) {
         usage();
         exit(EXIT_FAILURE);
@@ -941,21 +3918,170 @@ int main(int argc, char **argv) {
             --argc;
             ++argv;
         }
-        else if (!strcmp(argv[1], "-version") ||
-                 !strcmp(argv[1], "--version"))
+        else if (!strcmp(argv[1], "-version") ||
+                 !strcmp(argv[1], "--version"))
+        {
+            version();
+            exit(EXIT_SUCCESS);
+        }
+        else if (!strcmp(argv[1], "-trace")) {
+            --argc;
+            ++argv;
+            xflags |= VMXF_TRACE;
+        }
+        else if (!strcmp(argv[1], "-profile")) {
+            --argc;
+            ++argv;
+            xflags |= VMXF_PROFILE;
+        }
+        else if (!strcmp(argv[1], "-profile-counts")) {
+            --argc;
+            ++argv;
+            profilecounts = true;
+            xflags |= VMXF_PROFILE;
+        }
+        else if (!strcmp(argv[1], "-flamegraph")) {
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            flamegraph = argv[1];
+            xflags |= VMXF_PROFILE;
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-bench") || !strcmp(argv[1], "-warmup")) {
+            bool bench = !strcmp(argv[1], "-bench");
+            char *end;
+            unsigned long runs;
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            runs = strtoul(argv[1], &end, 10);
+            if (*end || (bench && !runs)) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            if (bench)
+                benchruns = runs;
+            else
+                warmupruns = runs;
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-func")) {
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            fnname = argv[1];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-batch")) {
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            batchfile = argv[1];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-snapshot")) {
+            --argc;
+            ++argv;
+            snapshot = true;
+        }
+        else if (!strcmp(argv[1], "-reload")) {
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            reloadfile = argv[1];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-record") || !strcmp(argv[1], "-replay")) {
+            bool record = !strcmp(argv[1], "-record");
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            if (record)
+                recordfile = argv[1];
+            else
+                replayfile = argv[1];
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-jobs")) {
+            char *end;
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            batchjobs = strtoul(argv[1], &end, 10);
+            if (*end || !batchjobs) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-maxjumps")     ||
+                 !strcmp(argv[1], "-maxgotos")      ||
+                 !strcmp(argv[1], "-maxstatements") ||
+                 !strcmp(argv[1], "-maxtime"))
         {
-            version();
-            exit(EXIT_SUCCESS);
+            const char *opt = argv[1];
+            char *end;
+            unsigned long long value;
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            value = strtoull(argv[1], &end, 10);
+            if (*end) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            if (!strcmp(opt, "-maxjumps"))
+                budget.jumps = value > LONG_MAX ? LONG_MAX : (long)value;
+            else if (!strcmp(opt, "-maxgotos"))
+                budget.gotos = value > LONG_MAX ? LONG_MAX : (long)value;
+            else if (!strcmp(opt, "-maxstatements"))
+                budget.statements = value;
+            else
+                budget.nanoseconds = value * 1000000;
+            --argc;
+            ++argv;
         }
-        else if (!strcmp(argv[1], "-trace")) {
+        else if (!strcmp(argv[1], "-threaded")) {
             --argc;
             ++argv;
-            xflags |= VMXF_TRACE;
+            xflags |= VMXF_THREADED;
         }
-        else if (!strcmp(argv[1], "-profile")) {
+        else if (!strcmp(argv[1], "-lazylocals")) {
             --argc;
             ++argv;
-            xflags |= VMXF_PROFILE;
+            xflags |= VMXF_LAZYLOCALS;
         }
         else if (!strcmp(argv[1], "-info")) {
             --argc;
@@ -981,6 +4107,36 @@ int main(int argc, char **argv) {
             ++argv;
             noexec = true;
         }
+        else if (!strcmp(argv[1], "-entcolumns")) {
+            --argc;
+            ++argv;
+            lflags |= VMLF_COLUMNS;
+        }
+        else if (!strcmp(argv[1], "-mmap")) {
+            --argc;
+            ++argv;
+            lflags |= VMLF_MMAP;
+        }
+        else if (!strcmp(argv[1], "-entreuse")) {
+            --argc;
+            ++argv;
+            if (argc <= 1) {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            if (!strcmp(argv[1], "lowest"))
+                opts_entreuse = VMENT_REUSE_LOWEST;
+            else if (!strcmp(argv[1], "lifo"))
+                opts_entreuse = VMENT_REUSE_LIFO;
+            else if (!strcmp(argv[1], "fifo"))
+                opts_entreuse = VMENT_REUSE_FIFO;
+            else {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            --argc;
+            ++argv;
+        }
         else if (!strcmp(argv[1], "-printdefs")) {
             --argc;
             ++argv;
@@ -1060,14 +4216,37 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    prog = prog_load(progsfile, noexec);
+    if (batchfile && (benchruns || (xflags & (VMXF_TRACE|VMXF_PROFILE)))) {
+        fprintf(stderr, "-batch cannot be combined with -bench, -trace or -profile\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((recordfile || replayfile) && (batchfile || benchruns)) {
+        fprintf(stderr, "-record and -replay cannot be combined with -batch or -bench\n");
+        exit(EXIT_FAILURE);
+    }
+    if (snapshot && (batchfile || benchruns || recordfile || replayfile)) {
+        fprintf(stderr, "-snapshot cannot be combined with -batch, -bench, -record or -replay\n");
+        exit(EXIT_FAILURE);
+    }
+    if (reloadfile && (batchfile || benchruns || recordfile || replayfile || snapshot)) {
+        fprintf(stderr, "-reload cannot be combined with -batch, -bench, -record, -replay or -snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!batchjobs)
+        batchjobs = 1;
+
+    prog = prog_load(progsfile, noexec, lflags);
     if (!prog) {
         fprintf(stderr, "failed to load program '%s'\n", progsfile);
         exit(EXIT_FAILURE);
     }
 
-    prog->builtins       = qc_builtins;
-    prog->builtins_count = GMQCC_ARRAY_COUNT(qc_builtins);
+    prog_register_builtins(prog, qc_builtins, GMQCC_ARRAY_COUNT(qc_builtins));
+    prog->entityreuse = opts_entreuse;
+    state.quiet       = false;
+    state.capture     = false;
+    state.output      = nullptr;
+    prog->userdata    = &state;
 
     if (opts_info) {
         printf("Program's system-checksum = 0x%04x\n", (unsigned int)prog->crc16);
@@ -1091,15 +4270,10 @@ int main(int argc, char **argv) {
         return 0;
     }
     for (i = 0; i < vec_size(dis_list); ++i) {
-        size_t k;
+        qcint_t fn;
         printf("Looking for `%s`\n", dis_list[i]);
-        for (k = 1; k < prog->functions.size(); ++k) {
-            const char *name = prog_getstring(prog, prog->functions[k].name);
-            if (!strcmp(name, dis_list[i])) {
-                prog_disasm_function(prog, k);
-                break;
-            }
-        }
+        if ((fn = prog_main_findfunction(prog, dis_list[i])) > 0)
+            prog_disasm_function(prog, fn);
     }
     if (opts_disasm) {
         for (i = 1; i < prog->functions.size(); ++i)
@@ -1188,21 +4362,79 @@ int main(int argc, char **argv) {
         }
     }
     if (!noexec) {
-        for (i = 1; i < prog->functions.size(); ++i) {
-            const char *name = prog_getstring(prog, prog->functions[i].name);
-            if (!strcmp(name, "main"))
-                fnmain = (qcint_t)i;
+        fnmain = prog_main_findfunction(prog, fnname);
+        if (batchfile)
+        {
+            if (!prog_main_batch(prog, batchfile, fnmain, xflags, &budget, batchjobs)) {
+                prog_delete(prog);
+                vec_free(main_params);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (fnmain > 0 && benchruns)
+        {
+            state.quiet = true;
+            if (!prog_main_bench(prog, fnmain, main_params, xflags, benchruns, warmupruns)) {
+                prog_delete(prog);
+                vec_free(main_params);
+                exit(EXIT_FAILURE);
+            }
         }
-        if (fnmain > 0)
+        else if (fnmain > 0 && reloadfile)
         {
-            prog_main_setparams(prog);
-            prog_exec(prog, &prog->functions[fnmain], xflags, VM_JUMPS_DEFAULT);
+            qc_program_t *np = prog_main_reload(prog, fnmain, fnname, reloadfile, lflags,
+                                                main_params, xflags, &budget);
+            prog_delete(prog);
+            if (!np) {
+                vec_free(main_params);
+                exit(EXIT_FAILURE);
+            }
+            prog = np;
+            if (xflags & VMXF_PROFILE)
+                prog_main_profile(prog, flamegraph, profilecounts);
+        }
+        else if (fnmain > 0 && snapshot)
+        {
+            if (!prog_main_snapshot(prog, fnmain, main_params, xflags, &budget)) {
+                prog_delete(prog);
+                vec_free(main_params);
+                exit(EXIT_FAILURE);
+            }
+            if (xflags & VMXF_PROFILE)
+                prog_main_profile(prog, flamegraph, profilecounts);
+        }
+        else if (fnmain > 0)
+        {
+            /* with both -record and -replay main runs twice, recording the first run */
+            size_t runs = (recordfile && replayfile) ? 2 : 1;
+            for (i = 0; i < runs; ++i) {
+                bool replay = replayfile && (i || !recordfile);
+                if ((!replay && recordfile && !prog_trace_record(prog, recordfile)) ||
+                    (replay && !prog_trace_replay(prog, replayfile)))
+                {
+                    prog_delete(prog);
+                    vec_free(main_params);
+                    exit(EXIT_FAILURE);
+                }
+                prog_main_setparams(prog, main_params);
+                if (!prog_exec_budget(prog, &prog->functions[fnmain], xflags, &budget) && opts_v)
+                    fprintf(stderr, "%s", prog->errortrace);
+                /* a replay which diverged already failed like any other error in the run */
+                if (!prog_trace_end(prog) && !prog->vmerror) {
+                    prog_delete(prog);
+                    vec_free(main_params);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (xflags & VMXF_PROFILE)
+                prog_main_profile(prog, flamegraph, profilecounts);
         }
         else
-            fprintf(stderr, "No main function found\n");
+            fprintf(stderr, "No %s function found\n", fnname);
     }
 
     prog_delete(prog);
+    vec_free(main_params);
     return 0;
 }
 
@@ -1232,154 +4464,260 @@ static void prog_disasm_function(qc_program_t *prog, size_t id) {
  * sort of isn't, which makes it nicer looking.
  */
 
-#define OPA ( (qcany_t*) (&prog->globals[0] + st->o1.u1) )
-#define OPB ( (qcany_t*) (&prog->globals[0] + st->o2.u1) )
-#define OPC ( (qcany_t*) (&prog->globals[0] + st->o3.u1) )
+#define OPA (st->a)
+#define OPB (st->b)
+#define OPC (st->c)
 
 #define GLOBAL(x) ( (qcany_t*) (&prog->globals[0] + (x)) )
+#define ENTFIELD(e, f) ( prog->entitydata + (e) * prog->entitystride + (f) * prog->fieldstride )
 
 /* to be consistent with current darkplaces behaviour */
 #if !defined(FLOAT_IS_TRUE_FOR_INT)
 #   define FLOAT_IS_TRUE_FOR_INT(x) ( (x) & 0x7FFFFFFF )
 #endif
 
+/*
+ * Tracing and profiling want to see every statement, so only the other
+ * loops dispatch on the fused opcodes.
+ */
+#if QCVM_TRACE || QCVM_PROFILE
+#   define QCVM_OPCODE(st) ((st)->opcode)
+#else
+#   define QCVM_OPCODE(st) ((st)->fused)
+#endif
+
+/* the tracing loop also runs while recording or replaying a log */
+#if QCVM_TRACE
+#   define QCVM_BUILTIN(call) (prog->tracelog ? prog_tracelog_builtin(prog, (call)) : (call)->builtin(prog))
+#else
+#   define QCVM_BUILTIN(call) ((call)->builtin(prog))
+#endif
+
+/*
+ * Charges the statements from mark up to st against the budget, the
+ * next ones start at `next`.  Only backward jumps and calls check it, see
+ * prog_exec_budget.
+ */
+#define QCVM_CHARGE(next)                                                        \
+    (left -= (st - mark) + 1, mark = (next))
+#define QCVM_CHECKPOINT(next)                                                    \
+    do {                                                                         \
+        QCVM_CHARGE(next);                                                       \
+        if (left < 0 && prog_budget_expired(prog, &budget, &left))               \
+            goto cleanup;                                                        \
+    } while (0)
+
+/* IF, IFNOT and GOTO once they decided to jump, counted in `left' */
+#define QCVM_JUMP_COUNTED(left, limit)                                           \
+    do {                                                                         \
+        if (st->imm < 0) {                                                       \
+            if (--(left) <= 0) {                                                 \
+                qcvmerror(prog, "`%s` hit the runaway loop counter limit of %li jumps", \
+                          prog->filename, (limit));                              \
+                goto cleanup;                                                    \
+            }                                                                    \
+            QCVM_CHECKPOINT(st + st->imm);                                       \
+        }                                                                        \
+        st += st->imm - 1;      /* offset the s++ */                             \
+    } while (0)
+#define QCVM_JUMP QCVM_JUMP_COUNTED(jumpsleft, limits->jumps)
+#define QCVM_GOTO QCVM_JUMP_COUNTED(gotosleft, limits->gotos)
+
+/* the IFNOT half of the fused compare and branch opcodes */
+#define QCVM_FUSED_IFNOT                                                          \
+    ++st;                                                                        \
+    if (!FLOAT_IS_TRUE_FOR_INT(OPA->_int))                                       \
+        QCVM_JUMP
+
+/*
+ * The handlers below are written once and expanded either as the cases
+ * of a switch, or when QCVM_THREADED is set, as labels which jump to
+ * each other directly through a table indexed by opcode (computed goto).
+ * The threaded variant is only ever included once per function, since
+ * the labels would otherwise clash.
+ */
+#if QCVM_THREADED
+#   define QCVM_CASE(op) qcvm_label_##op:
+#   define QCVM_ILLEGAL  qcvm_label_illegal
+#   define QCVM_NEXT     goto *qcvm_dispatch[QCVM_OPCODE(++st)]
+#else
+#   define QCVM_CASE(op) case op:
+#   define QCVM_ILLEGAL  default
+#   define QCVM_NEXT     break
+#endif
+
+#if QCVM_THREADED
+{
+    static const void *const qcvm_dispatch[QCVM_OPCODE_COUNT] = {
+        &&qcvm_label_INSTR_DONE,     &&qcvm_label_INSTR_MUL_F,
+        &&qcvm_label_INSTR_MUL_V,    &&qcvm_label_INSTR_MUL_FV,
+        &&qcvm_label_INSTR_MUL_VF,   &&qcvm_label_INSTR_DIV_F,
+        &&qcvm_label_INSTR_ADD_F,    &&qcvm_label_INSTR_ADD_V,
+        &&qcvm_label_INSTR_SUB_F,    &&qcvm_label_INSTR_SUB_V,
+        &&qcvm_label_INSTR_EQ_F,     &&qcvm_label_INSTR_EQ_V,
+        &&qcvm_label_INSTR_EQ_S,     &&qcvm_label_INSTR_EQ_E,
+        &&qcvm_label_INSTR_EQ_FNC,   &&qcvm_label_INSTR_NE_F,
+        &&qcvm_label_INSTR_NE_V,     &&qcvm_label_INSTR_NE_S,
+        &&qcvm_label_INSTR_NE_E,     &&qcvm_label_INSTR_NE_FNC,
+        &&qcvm_label_INSTR_LE,       &&qcvm_label_INSTR_GE,
+        &&qcvm_label_INSTR_LT,       &&qcvm_label_INSTR_GT,
+        &&qcvm_label_INSTR_LOAD_F,   &&qcvm_label_INSTR_LOAD_V,
+        &&qcvm_label_INSTR_LOAD_S,   &&qcvm_label_INSTR_LOAD_ENT,
+        &&qcvm_label_INSTR_LOAD_FLD, &&qcvm_label_INSTR_LOAD_FNC,
+        &&qcvm_label_INSTR_ADDRESS,  &&qcvm_label_INSTR_STORE_F,
+        &&qcvm_label_INSTR_STORE_V,  &&qcvm_label_INSTR_STORE_S,
+        &&qcvm_label_INSTR_STORE_ENT,&&qcvm_label_INSTR_STORE_FLD,
+        &&qcvm_label_INSTR_STORE_FNC,&&qcvm_label_INSTR_STOREP_F,
+        &&qcvm_label_INSTR_STOREP_V, &&qcvm_label_INSTR_STOREP_S,
+        &&qcvm_label_INSTR_STOREP_ENT,&&qcvm_label_INSTR_STOREP_FLD,
+        &&qcvm_label_INSTR_STOREP_FNC,&&qcvm_label_INSTR_RETURN,
+        &&qcvm_label_INSTR_NOT_F,    &&qcvm_label_INSTR_NOT_V,
+        &&qcvm_label_INSTR_NOT_S,    &&qcvm_label_INSTR_NOT_ENT,
+        &&qcvm_label_INSTR_NOT_FNC,  &&qcvm_label_INSTR_IF,
+        &&qcvm_label_INSTR_IFNOT,    &&qcvm_label_INSTR_CALL0,
+        &&qcvm_label_INSTR_CALL1,    &&qcvm_label_INSTR_CALL2,
+        &&qcvm_label_INSTR_CALL3,    &&qcvm_label_INSTR_CALL4,
+        &&qcvm_label_INSTR_CALL5,    &&qcvm_label_INSTR_CALL6,
+        &&qcvm_label_INSTR_CALL7,    &&qcvm_label_INSTR_CALL8,
+        &&qcvm_label_INSTR_STATE,    &&qcvm_label_INSTR_GOTO,
+        &&qcvm_label_INSTR_AND,      &&qcvm_label_INSTR_OR,
+        &&qcvm_label_INSTR_BITAND,   &&qcvm_label_INSTR_BITOR,
+        &&qcvm_label_QCVM_LOAD,      &&qcvm_label_QCVM_LOAD_V,
+        &&qcvm_label_QCVM_ADDRESS,   &&qcvm_label_QCVM_CALL,
+        &&qcvm_label_illegal,
+        &&qcvm_label_QCVM_LOAD_STORE,     &&qcvm_label_QCVM_LOAD_STORE_V,
+        &&qcvm_label_QCVM_EQ_F_IFNOT,     &&qcvm_label_QCVM_NE_F_IFNOT,
+        &&qcvm_label_QCVM_LE_IFNOT,       &&qcvm_label_QCVM_GE_IFNOT,
+        &&qcvm_label_QCVM_LT_IFNOT,       &&qcvm_label_QCVM_GT_IFNOT,
+        &&qcvm_label_QCVM_ADDRESS_STOREP, &&qcvm_label_QCVM_CALL_STORE,
+        &&qcvm_label_QCVM_CALL_STORE_V
+    };
+    qcint_t          *data;
+
+    QCVM_NEXT;
+    {
+#else
 while (prog->vmerror == 0) {
-    prog_section_function_t  *newf;
-    qcany_t          *ed;
-    qcany_t          *ptr;
+    qcint_t          *data;
 
     ++st;
 
 #if QCVM_PROFILE
-    prog->profile[st - &prog->code[0]]++;
+    prog->profile[st - prog->decoded]++;
+    prog->profnodes[prog->profnode].self++;
 #endif
 
 #if QCVM_TRACE
-    prog_print_statement(prog, st);
+    if (prog->xflags & VMXF_TRACE)
+        prog_print_statement(prog, &prog->code[0] + (st - prog->decoded));
+    if (prog->tracelog && !prog_tracelog_statement(prog, st - prog->decoded))
+        goto cleanup;
 #endif
 
-    switch (st->opcode)
+    switch (QCVM_OPCODE(st))
     {
-        default:
+#endif
+        QCVM_ILLEGAL:
             qcvmerror(prog, "Illegal instruction in %s\n", prog->filename);
             goto cleanup;
 
-        case INSTR_DONE:
-        case INSTR_RETURN:
-            /* TODO: add instruction count to function profile count */
+        QCVM_CASE(INSTR_DONE)
+        QCVM_CASE(INSTR_RETURN)
             GLOBAL(OFS_RETURN)->ivector[0] = OPA->ivector[0];
             GLOBAL(OFS_RETURN)->ivector[1] = OPA->ivector[1];
             GLOBAL(OFS_RETURN)->ivector[2] = OPA->ivector[2];
 
-            st = &prog->code[0] + prog_leavefunction(prog);
+            left -= (st - mark) + 1;
+            st = prog->decoded + prog_leavefunction(prog);
+            mark = st + 1;
             if (!vec_size(prog->stack))
                 goto cleanup;
 
-            break;
+            QCVM_NEXT;
 
-        case INSTR_MUL_F:
+        QCVM_CASE(INSTR_MUL_F)
             OPC->_float = OPA->_float * OPB->_float;
-            break;
-        case INSTR_MUL_V:
-            OPC->_float = OPA->vector[0]*OPB->vector[0] +
-                          OPA->vector[1]*OPB->vector[1] +
-                          OPA->vector[2]*OPB->vector[2];
-            break;
-        case INSTR_MUL_FV:
-        {
-            qcfloat_t f = OPA->_float;
-            OPC->vector[0] = f * OPB->vector[0];
-            OPC->vector[1] = f * OPB->vector[1];
-            OPC->vector[2] = f * OPB->vector[2];
-            break;
-        }
-        case INSTR_MUL_VF:
-        {
-            qcfloat_t f = OPB->_float;
-            OPC->vector[0] = f * OPA->vector[0];
-            OPC->vector[1] = f * OPA->vector[1];
-            OPC->vector[2] = f * OPA->vector[2];
-            break;
-        }
-        case INSTR_DIV_F:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_MUL_V)
+            OPC->_float = prog_vec_dot(OPA->vector, OPB->vector);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_MUL_FV)
+            prog_vec_scale(OPC->vector, OPB->vector, OPA->_float);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_MUL_VF)
+            prog_vec_scale(OPC->vector, OPA->vector, OPB->_float);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_DIV_F)
             if (OPB->_float != 0.0f)
                 OPC->_float = OPA->_float / OPB->_float;
             else
                 OPC->_float = 0;
-            break;
+            QCVM_NEXT;
 
-        case INSTR_ADD_F:
+        QCVM_CASE(INSTR_ADD_F)
             OPC->_float = OPA->_float + OPB->_float;
-            break;
-        case INSTR_ADD_V:
-            OPC->vector[0] = OPA->vector[0] + OPB->vector[0];
-            OPC->vector[1] = OPA->vector[1] + OPB->vector[1];
-            OPC->vector[2] = OPA->vector[2] + OPB->vector[2];
-            break;
-        case INSTR_SUB_F:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_ADD_V)
+            prog_vec_add(OPC->vector, OPA->vector, OPB->vector);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_SUB_F)
             OPC->_float = OPA->_float - OPB->_float;
-            break;
-        case INSTR_SUB_V:
-            OPC->vector[0] = OPA->vector[0] - OPB->vector[0];
-            OPC->vector[1] = OPA->vector[1] - OPB->vector[1];
-            OPC->vector[2] = OPA->vector[2] - OPB->vector[2];
-            break;
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_SUB_V)
+            prog_vec_sub(OPC->vector, OPA->vector, OPB->vector);
+            QCVM_NEXT;
 
-        case INSTR_EQ_F:
+        QCVM_CASE(INSTR_EQ_F)
             OPC->_float = (OPA->_float == OPB->_float);
-            break;
-        case INSTR_EQ_V:
-            OPC->_float = ((OPA->vector[0] == OPB->vector[0]) &&
-                           (OPA->vector[1] == OPB->vector[1]) &&
-                           (OPA->vector[2] == OPB->vector[2]) );
-            break;
-        case INSTR_EQ_S:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_EQ_V)
+            OPC->_float = prog_vec_eq(OPA->vector, OPB->vector);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_EQ_S)
             OPC->_float = !strcmp(prog_getstring(prog, OPA->string),
                                   prog_getstring(prog, OPB->string));
-            break;
-        case INSTR_EQ_E:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_EQ_E)
             OPC->_float = (OPA->_int == OPB->_int);
-            break;
-        case INSTR_EQ_FNC:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_EQ_FNC)
             OPC->_float = (OPA->function == OPB->function);
-            break;
-        case INSTR_NE_F:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NE_F)
             OPC->_float = (OPA->_float != OPB->_float);
-            break;
-        case INSTR_NE_V:
-            OPC->_float = ((OPA->vector[0] != OPB->vector[0]) ||
-                           (OPA->vector[1] != OPB->vector[1]) ||
-                           (OPA->vector[2] != OPB->vector[2]) );
-            break;
-        case INSTR_NE_S:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NE_V)
+            OPC->_float = !prog_vec_eq(OPA->vector, OPB->vector);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NE_S)
             OPC->_float = !!strcmp(prog_getstring(prog, OPA->string),
                                    prog_getstring(prog, OPB->string));
-            break;
-        case INSTR_NE_E:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NE_E)
             OPC->_float = (OPA->_int != OPB->_int);
-            break;
-        case INSTR_NE_FNC:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NE_FNC)
             OPC->_float = (OPA->function != OPB->function);
-            break;
+            QCVM_NEXT;
 
-        case INSTR_LE:
+        QCVM_CASE(INSTR_LE)
             OPC->_float = (OPA->_float <= OPB->_float);
-            break;
-        case INSTR_GE:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_GE)
             OPC->_float = (OPA->_float >= OPB->_float);
-            break;
-        case INSTR_LT:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_LT)
             OPC->_float = (OPA->_float < OPB->_float);
-            break;
-        case INSTR_GT:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_GT)
             OPC->_float = (OPA->_float > OPB->_float);
-            break;
+            QCVM_NEXT;
 
-        case INSTR_LOAD_F:
-        case INSTR_LOAD_S:
-        case INSTR_LOAD_FLD:
-        case INSTR_LOAD_ENT:
-        case INSTR_LOAD_FNC:
+        QCVM_CASE(INSTR_LOAD_F)
+        QCVM_CASE(INSTR_LOAD_S)
+        QCVM_CASE(INSTR_LOAD_FLD)
+        QCVM_CASE(INSTR_LOAD_ENT)
+        QCVM_CASE(INSTR_LOAD_FNC)
             if (OPA->edict < 0 || OPA->edict >= prog->entities) {
                 qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
                 goto cleanup;
@@ -1390,10 +4728,9 @@ while (prog->vmerror == 0) {
                           OPB->_int);
                 goto cleanup;
             }
-            ed = prog_getedict(prog, OPA->edict);
-            OPC->_int = ((qcany_t*)( ((qcint_t*)ed) + OPB->_int ))->_int;
-            break;
-        case INSTR_LOAD_V:
+            OPC->_int = *ENTFIELD(OPA->edict, OPB->_int);
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_LOAD_V)
             if (OPA->edict < 0 || OPA->edict >= prog->entities) {
                 qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
                 goto cleanup;
@@ -1405,14 +4742,13 @@ while (prog->vmerror == 0) {
                           OPB->_int + 2);
                 goto cleanup;
             }
-            ed = prog_getedict(prog, OPA->edict);
-            ptr = (qcany_t*)( ((qcint_t*)ed) + OPB->_int );
-            OPC->ivector[0] = ptr->ivector[0];
-            OPC->ivector[1] = ptr->ivector[1];
-            OPC->ivector[2] = ptr->ivector[2];
-            break;
+            data = ENTFIELD(OPA->edict, OPB->_int);
+            OPC->ivector[0] = data[0];
+            OPC->ivector[1] = data[prog->fieldstride];
+            OPC->ivector[2] = data[prog->fieldstride * 2];
+            QCVM_NEXT;
 
-        case INSTR_ADDRESS:
+        QCVM_CASE(INSTR_ADDRESS)
             if (OPA->edict < 0 || OPA->edict >= prog->entities) {
                 qcvmerror(prog, "prog `%s` attempted to address an out of bounds entity %i", prog->filename, OPA->edict);
                 goto cleanup;
@@ -1425,29 +4761,154 @@ while (prog->vmerror == 0) {
                 goto cleanup;
             }
 
-            ed = prog_getedict(prog, OPA->edict);
-            OPC->_int = ((qcint_t*)ed) - prog->entitydata + OPB->_int;
-            break;
+            OPC->_int = prog->entityfields * OPA->edict + OPB->_int;
+            QCVM_NEXT;
 
-        case INSTR_STORE_F:
-        case INSTR_STORE_S:
-        case INSTR_STORE_ENT:
-        case INSTR_STORE_FLD:
-        case INSTR_STORE_FNC:
+        /* the field operand of these was proven valid by prog_decode */
+        QCVM_CASE(QCVM_LOAD)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
+                goto cleanup;
+            }
+            OPC->_int = *ENTFIELD(OPA->edict, OPB->_int);
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_LOAD_V)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
+                goto cleanup;
+            }
+            data = ENTFIELD(OPA->edict, OPB->_int);
+            OPC->ivector[0] = data[0];
+            OPC->ivector[1] = data[prog->fieldstride];
+            OPC->ivector[2] = data[prog->fieldstride * 2];
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_ADDRESS)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "prog `%s` attempted to address an out of bounds entity %i", prog->filename, OPA->edict);
+                goto cleanup;
+            }
+            OPC->_int = prog->entityfields * OPA->edict + OPB->_int;
+            QCVM_NEXT;
+
+        /* fused pairs, the second half runs with st on the second statement */
+        QCVM_CASE(QCVM_LOAD_STORE)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
+                goto cleanup;
+            }
+            OPC->_int = *ENTFIELD(OPA->edict, OPB->_int);
+            ++st;
             OPB->_int = OPA->_int;
-            break;
-        case INSTR_STORE_V:
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_LOAD_STORE_V)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "progs `%s` attempted to read an out of bounds entity", prog->filename);
+                goto cleanup;
+            }
+            data = ENTFIELD(OPA->edict, OPB->_int);
+            OPC->ivector[0] = data[0];
+            OPC->ivector[1] = data[prog->fieldstride];
+            OPC->ivector[2] = data[prog->fieldstride * 2];
+            ++st;
             OPB->ivector[0] = OPA->ivector[0];
             OPB->ivector[1] = OPA->ivector[1];
             OPB->ivector[2] = OPA->ivector[2];
-            break;
+            QCVM_NEXT;
 
-        case INSTR_STOREP_F:
-        case INSTR_STOREP_S:
-        case INSTR_STOREP_ENT:
-        case INSTR_STOREP_FLD:
-        case INSTR_STOREP_FNC:
-            if (OPB->_int < 0 || OPB->_int >= (qcint_t)vec_size(prog->entitydata)) {
+        QCVM_CASE(QCVM_EQ_F_IFNOT)
+            OPC->_float = (OPA->_float == OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_NE_F_IFNOT)
+            OPC->_float = (OPA->_float != OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_LE_IFNOT)
+            OPC->_float = (OPA->_float <= OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_GE_IFNOT)
+            OPC->_float = (OPA->_float >= OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_LT_IFNOT)
+            OPC->_float = (OPA->_float < OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+        QCVM_CASE(QCVM_GT_IFNOT)
+            OPC->_float = (OPA->_float > OPB->_float);
+            QCVM_FUSED_IFNOT;
+            QCVM_NEXT;
+
+        QCVM_CASE(QCVM_ADDRESS_STOREP)
+            if (OPA->edict < 0 || OPA->edict >= prog->entities) {
+                qcvmerror(prog, "prog `%s` attempted to address an out of bounds entity %i", prog->filename, OPA->edict);
+                goto cleanup;
+            }
+            OPC->_int = prog->entityfields * OPA->edict + OPB->_int;
+            ++st;
+            /* the address is inside the entity data, only world needs checking */
+            if (OPB->_int < (qcint_t)prog->entityfields && !prog->allowworldwrites)
+                qcvmerror(prog, "`%s` tried to assign to world.%s (field %i)\n",
+                          prog->filename,
+                          prog_getstring(prog, prog_entfield(prog, OPB->_int)->name),
+                          OPB->_int);
+            *prog_entdirty(prog, prog_entpointer(prog, OPB->_int)) = OPA->_int;
+            if (prog->vmerror)
+                goto cleanup;
+            QCVM_NEXT;
+
+        /* only builtins return right away, anything else runs the store as usual */
+        QCVM_CASE(QCVM_CALL_STORE)
+        QCVM_CASE(QCVM_CALL_STORE_V)
+            if (!prog_call_lookup(prog, st->call, OPA->function))
+                goto cleanup;
+            QCVM_CHECKPOINT(st + 1);
+            prog->argc = st->imm;
+            prog->statement = (st - prog->decoded) + 1;
+
+            if (!st->call->builtin) {
+                st = prog->decoded + prog_enterfunction(prog, st->call->target) - 1; /* offset st++ */
+                mark = st + 1;
+                if (prog->vmerror)
+                    goto cleanup;
+                QCVM_NEXT;
+            }
+
+            st->call->builtin(prog);
+            if (prog->vmerror)
+                goto cleanup;
+
+            if (st->fused == QCVM_CALL_STORE_V) {
+                ++st;
+                OPB->ivector[0] = OPA->ivector[0];
+                OPB->ivector[1] = OPA->ivector[1];
+                OPB->ivector[2] = OPA->ivector[2];
+            } else {
+                ++st;
+                OPB->_int = OPA->_int;
+            }
+            QCVM_NEXT;
+
+        QCVM_CASE(INSTR_STORE_F)
+        QCVM_CASE(INSTR_STORE_S)
+        QCVM_CASE(INSTR_STORE_ENT)
+        QCVM_CASE(INSTR_STORE_FLD)
+        QCVM_CASE(INSTR_STORE_FNC)
+            OPB->_int = OPA->_int;
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_STORE_V)
+            OPB->ivector[0] = OPA->ivector[0];
+            OPB->ivector[1] = OPA->ivector[1];
+            OPB->ivector[2] = OPA->ivector[2];
+            QCVM_NEXT;
+
+        QCVM_CASE(INSTR_STOREP_F)
+        QCVM_CASE(INSTR_STOREP_S)
+        QCVM_CASE(INSTR_STOREP_ENT)
+        QCVM_CASE(INSTR_STOREP_FLD)
+        QCVM_CASE(INSTR_STOREP_FNC)
+            if (OPB->_int < 0 || OPB->_int >= prog->entities * (qcint_t)prog->entityfields) {
                 qcvmerror(prog, "`%s` attempted to write to an out of bounds edict (%i)", prog->filename, OPB->_int);
                 goto cleanup;
             }
@@ -1456,11 +4917,12 @@ while (prog->vmerror == 0) {
                           prog->filename,
                           prog_getstring(prog, prog_entfield(prog, OPB->_int)->name),
                           OPB->_int);
-            ptr = (qcany_t*)(prog->entitydata + OPB->_int);
-            ptr->_int = OPA->_int;
-            break;
-        case INSTR_STOREP_V:
-            if (OPB->_int < 0 || OPB->_int + 2 >= (qcint_t)vec_size(prog->entitydata)) {
+            *prog_entdirty(prog, prog_entpointer(prog, OPB->_int)) = OPA->_int;
+            if (prog->vmerror)
+                goto cleanup;
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_STOREP_V)
+            if (OPB->_int < 0 || OPB->_int + 2 >= prog->entities * (qcint_t)prog->entityfields) {
                 qcvmerror(prog, "`%s` attempted to write to an out of bounds edict (%i)", prog->filename, OPB->_int);
                 goto cleanup;
             }
@@ -1469,133 +4931,135 @@ while (prog->vmerror == 0) {
                           prog->filename,
                           prog_getstring(prog, prog_entfield(prog, OPB->_int)->name),
                           OPB->_int);
-            ptr = (qcany_t*)(prog->entitydata + OPB->_int);
-            ptr->ivector[0] = OPA->ivector[0];
-            ptr->ivector[1] = OPA->ivector[1];
-            ptr->ivector[2] = OPA->ivector[2];
-            break;
+            *prog_entdirty(prog, prog_entpointer(prog, OPB->_int))     = OPA->ivector[0];
+            *prog_entdirty(prog, prog_entpointer(prog, OPB->_int + 1)) = OPA->ivector[1];
+            *prog_entdirty(prog, prog_entpointer(prog, OPB->_int + 2)) = OPA->ivector[2];
+            if (prog->vmerror)
+                goto cleanup;
+            QCVM_NEXT;
 
-        case INSTR_NOT_F:
+        QCVM_CASE(INSTR_NOT_F)
             OPC->_float = !FLOAT_IS_TRUE_FOR_INT(OPA->_int);
-            break;
-        case INSTR_NOT_V:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NOT_V)
             OPC->_float = !OPA->vector[0] &&
                           !OPA->vector[1] &&
                           !OPA->vector[2];
-            break;
-        case INSTR_NOT_S:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NOT_S)
             OPC->_float = !OPA->string ||
                           !*prog_getstring(prog, OPA->string);
-            break;
-        case INSTR_NOT_ENT:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NOT_ENT)
             OPC->_float = (OPA->edict == 0);
-            break;
-        case INSTR_NOT_FNC:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_NOT_FNC)
             OPC->_float = !OPA->function;
-            break;
+            QCVM_NEXT;
 
-        case INSTR_IF:
+        QCVM_CASE(INSTR_IF)
             /* this is consistent with darkplaces' behaviour */
             if(FLOAT_IS_TRUE_FOR_INT(OPA->_int))
-            {
-                st += st->o2.s1 - 1;    /* offset the s++ */
-                if (++jumpcount >= maxjumps)
-                    qcvmerror(prog, "`%s` hit the runaway loop counter limit of %li jumps", prog->filename, jumpcount);
-            }
-            break;
-        case INSTR_IFNOT:
+                QCVM_JUMP;
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_IFNOT)
             if(!FLOAT_IS_TRUE_FOR_INT(OPA->_int))
-            {
-                st += st->o2.s1 - 1;    /* offset the s++ */
-                if (++jumpcount >= maxjumps)
-                    qcvmerror(prog, "`%s` hit the runaway loop counter limit of %li jumps", prog->filename, jumpcount);
-            }
-            break;
-
-        case INSTR_CALL0:
-        case INSTR_CALL1:
-        case INSTR_CALL2:
-        case INSTR_CALL3:
-        case INSTR_CALL4:
-        case INSTR_CALL5:
-        case INSTR_CALL6:
-        case INSTR_CALL7:
-        case INSTR_CALL8:
-            prog->argc = st->opcode - INSTR_CALL0;
-            if (!OPA->function)
-                qcvmerror(prog, "nullptr function in `%s`", prog->filename);
-
-            if(!OPA->function || OPA->function >= (qcint_t)prog->functions.size())
-            {
-                qcvmerror(prog, "CALL outside the program in `%s`", prog->filename);
+                QCVM_JUMP;
+            QCVM_NEXT;
+
+        QCVM_CASE(INSTR_CALL0)
+        QCVM_CASE(INSTR_CALL1)
+        QCVM_CASE(INSTR_CALL2)
+        QCVM_CASE(INSTR_CALL3)
+        QCVM_CASE(INSTR_CALL4)
+        QCVM_CASE(INSTR_CALL5)
+        QCVM_CASE(INSTR_CALL6)
+        QCVM_CASE(INSTR_CALL7)
+        QCVM_CASE(INSTR_CALL8)
+        QCVM_CASE(QCVM_CALL)
+            if (!prog_call_lookup(prog, st->call, OPA->function))
                 goto cleanup;
-            }
-
-            newf = &prog->functions[OPA->function];
-            newf->profile++;
+            QCVM_CHECKPOINT(st + 1);
+            prog->argc = st->imm;
+            prog->statement = (st - prog->decoded) + 1;
 
-            prog->statement = (st - &prog->code[0]) + 1;
-
-            if (newf->entry < 0)
-            {
-                /* negative statements are built in functions */
-                qcint_t builtinnumber = -newf->entry;
-                if (builtinnumber < (qcint_t)prog->builtins_count && prog->builtins[builtinnumber])
-                    prog->builtins[builtinnumber](prog);
-                else
-                    qcvmerror(prog, "No such builtin #%i in %s! Try updating your gmqcc sources",
-                              builtinnumber, prog->filename);
+            if (st->call->builtin) {
+#if QCVM_PROFILE
+                size_t parent = prog_profile_enter(prog, st->call->target);
+                QCVM_BUILTIN(st->call);
+                prog_profile_leave(prog, parent);
+#else
+                QCVM_BUILTIN(st->call);
+#endif
+            }
+            else {
+                st = prog->decoded + prog_enterfunction(prog, st->call->target) - 1; /* offset st++ */
+                mark = st + 1;
             }
-            else
-                st = &prog->code[0] + prog_enterfunction(prog, newf) - 1; /* offset st++ */
             if (prog->vmerror)
                 goto cleanup;
-            break;
+            QCVM_NEXT;
 
-        case INSTR_STATE:
+        QCVM_CASE(INSTR_STATE)
         {
             qcfloat_t *nextthink;
             qcfloat_t *time;
             qcfloat_t *frame;
+            qcint_t    self;
             if (!prog->supports_state) {
                 qcvmerror(prog, "`%s` tried to execute a STATE operation but misses its defs!", prog->filename);
                 goto cleanup;
             }
-            ed = prog_getedict(prog, prog->globals[prog->cached_globals.self]);
-            ((qcint_t*)ed)[prog->cached_fields.think] = OPB->function;
+            /* complains about and falls back to world for a bad self */
+            self = prog->globals[prog->cached_globals.self];
+            prog_edictfield(prog, self, prog->cached_fields.think)->function = OPB->function;
+            if (self >= prog->entities)
+                self = 0;
 
-            frame     = (qcfloat_t*)&((qcint_t*)ed)[prog->cached_fields.frame];
+            frame     = (qcfloat_t*)prog_entdirty(prog, ENTFIELD(self, prog->cached_fields.frame));
             *frame    = OPA->_float;
-            nextthink = (qcfloat_t*)&((qcint_t*)ed)[prog->cached_fields.nextthink];
+            nextthink = (qcfloat_t*)prog_entdirty(prog, ENTFIELD(self, prog->cached_fields.nextthink));
             time      = (qcfloat_t*)(&prog->globals[0] + prog->cached_globals.time);
             *nextthink = *time + 0.1;
-            break;
+            if (prog->vmerror)
+                goto cleanup;
+            QCVM_NEXT;
         }
 
-        case INSTR_GOTO:
-            st += st->o1.s1 - 1;    /* offset the s++ */
-            if (++jumpcount == 10000000)
-                qcvmerror(prog, "`%s` hit the runaway loop counter limit of %li jumps", prog->filename, jumpcount);
-            break;
+        QCVM_CASE(INSTR_GOTO)
+            QCVM_GOTO;
+            QCVM_NEXT;
 
-        case INSTR_AND:
+        QCVM_CASE(INSTR_AND)
             OPC->_float = FLOAT_IS_TRUE_FOR_INT(OPA->_int) &&
                           FLOAT_IS_TRUE_FOR_INT(OPB->_int);
-            break;
-        case INSTR_OR:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_OR)
             OPC->_float = FLOAT_IS_TRUE_FOR_INT(OPA->_int) ||
                           FLOAT_IS_TRUE_FOR_INT(OPB->_int);
-            break;
+            QCVM_NEXT;
 
-        case INSTR_BITAND:
+        QCVM_CASE(INSTR_BITAND)
             OPC->_float = ((int)OPA->_float) & ((int)OPB->_float);
-            break;
-        case INSTR_BITOR:
+            QCVM_NEXT;
+        QCVM_CASE(INSTR_BITOR)
             OPC->_float = ((int)OPA->_float) | ((int)OPB->_float);
-            break;
+            QCVM_NEXT;
     }
 }
 
+#undef QCVM_CASE
+#undef QCVM_ILLEGAL
+#undef QCVM_NEXT
+#undef QCVM_OPCODE
+#undef QCVM_BUILTIN
+#undef QCVM_FUSED_IFNOT
+#undef QCVM_JUMP
+#undef QCVM_GOTO
+#undef QCVM_JUMP_COUNTED
+#undef QCVM_CHECKPOINT
+#undef QCVM_CHARGE
 #undef QCVM_PROFILE
 #undef QCVM_TRACE
+#undef QCVM_THREADED
 #endif /* !QCVM_LOOP */
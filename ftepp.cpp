@@ -6,6 +6,7 @@
 #include "lexer.h"
 
 #define HT_MACROS 1024
+#define HT_INCLUDES 64
 
 struct ppcondition {
     bool on;
@@ -35,6 +36,51 @@ struct ppmacro {
     pptoken **output;
 };
 
+/*
+ * Include cache: the tokens of an included file, recorded with the lexer
+ * flags they were read with, so including it again replays them rather
+ * than lexing the file again.
+ */
+struct ppinctoken {
+    int      ttype;
+    unsigned flags;   /* the lexer flags the token was read with */
+    size_t   value;   /* offset into ppinclude::values */
+    size_t   length;
+    decltype(token::constval) constval;  /* a copy from the lexer */
+    size_t   ctxline;
+    size_t   ctxcolumn;
+    /* lexer state after the token */
+    size_t   line;
+    size_t   sline;
+    size_t   column;
+    bool     eof;
+};
+
+struct ppinclude {
+    time_t      mtime;
+    off_t       size;
+    ppinctoken *tokens;
+    char       *values;
+    char       *guard;  /* the macro guarding the whole file, if any */
+    bool        failed; /* the recording can not be used */
+    size_t      users;  /* includes replaying it right now */
+};
+
+/*
+ * Output: a list of segments which are filled in order and never moved,
+ * so adding to it never copies what was written before, and the parser
+ * reads the segments where they are (lex_open_segments).
+ */
+#define PP_SEGMENT_MIN 256
+#define PP_SEGMENT_MAX 65536
+
+struct ppoutput {
+    lex_segment *segments; /* the data is allocated with mem_a */
+    char        *at;       /* end of the last segment */
+    size_t       room;     /* space left after it */
+    size_t       length;
+};
+
 struct ftepp_t {
     lex_file *lex;
     int token;
@@ -42,12 +88,18 @@ struct ftepp_t {
     bool output_on;
     ppcondition *conditions;
     ht macros;  /* hashtable<string, ppmacro*> */
-    char *output_string;
+    ppoutput output;
     char *itemname;
     char *includename;
     bool in_macro;
     uint32_t predef_countval;
     uint32_t predef_randval;
+
+    ht includes;        /* hashtable<string, ppinclude*> */
+    lex_file *inc_lex;  /* the lexer being recorded or replayed */
+    ppinclude *inc;
+    size_t inc_at;      /* replay position */
+    bool inc_replay;
 };
 
 /* __DATE__ */
@@ -256,6 +308,24 @@ static void ppmacro_delete(ppmacro *self)
     mem_d(self);
 }
 
+static ppinclude *ppinclude_new(const struct stat *st)
+{
+    ppinclude *inc = (ppinclude*)mem_a(sizeof(ppinclude));
+    memset(inc, 0, sizeof(*inc));
+    inc->mtime = st->st_mtime;
+    inc->size  = st->st_size;
+    return inc;
+}
+
+static void ppinclude_delete(ppinclude *self)
+{
+    vec_free(self->tokens);
+    vec_free(self->values);
+    if (self->guard)
+        mem_d(self->guard);
+    mem_d(self);
+}
+
 static ftepp_t* ftepp_new(void)
 {
     ftepp_t *ftepp;
@@ -264,6 +334,7 @@ static ftepp_t* ftepp_new(void)
     memset(ftepp, 0, sizeof(*ftepp));
 
     ftepp->macros          = util_htnew(HT_MACROS);
+    ftepp->includes        = util_htnew(HT_INCLUDES);
     ftepp->output_on       = true;
     ftepp->predef_countval = 0;
     ftepp->predef_randval  = 0;
@@ -271,9 +342,100 @@ static ftepp_t* ftepp_new(void)
     return ftepp;
 }
 
+static void ppoutput_free(ppoutput *out)
+{
+    size_t i;
+    for (i = 0; i < vec_size(out->segments); ++i)
+        mem_d((void*)out->segments[i].data);
+    vec_free(out->segments);
+    out->at     = nullptr;
+    out->room   = 0;
+    out->length = 0;
+}
+
+/* segments get larger with the output, and always fit the string added */
+static void ppoutput_grow(ppoutput *out, size_t len)
+{
+    lex_segment seg;
+    size_t      size = out->length;
+
+    if (size < PP_SEGMENT_MIN)
+        size = PP_SEGMENT_MIN;
+    if (size > PP_SEGMENT_MAX)
+        size = PP_SEGMENT_MAX;
+    if (size < len)
+        size = len;
+
+    out->at     = (char*)mem_a(size);
+    out->room   = size;
+    seg.data    = out->at;
+    seg.length  = 0;
+    vec_push(out->segments, seg);
+}
+
+static void ppoutput_add(ppoutput *out, const char *str, size_t len)
+{
+    if (!len)
+        return;
+    if (len > out->room)
+        ppoutput_grow(out, len);
+    memcpy(out->at, str, len);
+    out->at     += len;
+    out->room   -= len;
+    out->length += len;
+    vec_last(out->segments).length += len;
+}
+
+/* Moves the contents of `from' to the end of `out'. They're only copied
+ * when they fit into the room left in its last segment.
+ */
+static void ppoutput_take(ppoutput *out, ppoutput *from)
+{
+    size_t i;
+    if (from->length <= out->room) {
+        for (i = 0; i < vec_size(from->segments); ++i)
+            ppoutput_add(out, from->segments[i].data, from->segments[i].length);
+        ppoutput_free(from);
+        return;
+    }
+
+    for (i = 0; i < vec_size(from->segments); ++i)
+        vec_push(out->segments, from->segments[i]);
+    out->at      = from->at;
+    out->room    = from->room;
+    out->length += from->length;
+
+    vec_free(from->segments);
+    from->at     = nullptr;
+    from->room   = 0;
+    from->length = 0;
+}
+
+static bool ppoutput_haschr(const ppoutput *out, int ch)
+{
+    size_t i;
+    for (i = 0; i < vec_size(out->segments); ++i)
+        if (memchr(out->segments[i].data, ch, out->segments[i].length))
+            return true;
+    return false;
+}
+
+static char *ppoutput_strdup(const ppoutput *out)
+{
+    char  *str = (char*)mem_a(out->length + 1);
+    size_t at  = 0;
+    size_t i;
+    for (i = 0; i < vec_size(out->segments); ++i) {
+        memcpy(str + at, out->segments[i].data, out->segments[i].length);
+        at += out->segments[i].length;
+    }
+    str[at] = 0;
+    return str;
+}
+
 static GMQCC_INLINE void ftepp_flush_do(ftepp_t *self)
 {
-    vec_free(self->output_string);
+    ppoutput_free(&self->output);
 }
 
 static void ftepp_delete(ftepp_t *self)
@@ -285,6 +447,7 @@ static void ftepp_delete(ftepp_t *self)
         vec_free(self->includename);
 
     util_htrem(self->macros, (void (*)(void*))&ppmacro_delete);
+    util_htrem(self->includes, (void (*)(void*))&ppinclude_delete);
 
     vec_free(self->conditions);
     if (self->lex)
@@ -295,13 +458,7 @@ static void ftepp_delete(ftepp_t *self)
 static void ftepp_out(ftepp_t *ftepp, const char *str, bool ignore_cond)
 {
     if (ignore_cond || ftepp->output_on)
-    {
-        size_t len;
-        char  *data;
-        len = strlen(str);
-        data = vec_add(ftepp->output_string, len);
-        memcpy(data, str, len);
-    }
+        ppoutput_add(&ftepp->output, str, strlen(str));
 }
 
 static GMQCC_INLINE void ftepp_update_output_condition(ftepp_t *ftepp)
@@ -322,8 +479,99 @@ static GMQCC_INLINE void ftepp_macro_delete(ftepp_t *ftepp, const char *name)
     util_htrm(ftepp->macros, name, (void (*)(void*))&ppmacro_delete);
 }
 
+static unsigned ftepp_include_flags(lex_file *lex)
+{
+    return lex->flags.preprocessing | lex->flags.mergelines << 1 | lex->flags.noops << 2;
+}
+
+/*
+ * Read the next token of an included file through the include cache:
+ * either record it or replay it. The tokens a file lexes to depend on
+ * the flags the directives set while reading it, so should a replay ask
+ * for a token with other flags than were recorded, the file is lexed
+ * again up to there with the recorded flags and read live from then on.
+ */
+static int ftepp_include_next(ftepp_t *ftepp)
+{
+    lex_file   *lex   = ftepp->lex;
+    ppinclude  *inc   = ftepp->inc;
+    unsigned    flags = ftepp_include_flags(lex);
+    ppinctoken *tok;
+    size_t      warnings, errors, i;
+
+    if (ftepp->inc_replay) {
+        if (ftepp->inc_at < vec_size(inc->tokens) && inc->tokens[ftepp->inc_at].flags != flags) {
+            lex->line   = 1;
+            lex->sline  = 0;
+            lex->column = 0;
+            lex->eof    = false;
+            for (i = 0; i < ftepp->inc_at; ++i) {
+                lex->flags.preprocessing = !!(inc->tokens[i].flags & 1);
+                lex->flags.mergelines    = !!(inc->tokens[i].flags & 2);
+                lex->flags.noops         = !!(inc->tokens[i].flags & 4);
+                (void)lex_do(lex);
+            }
+            lex->flags.preprocessing = !!(flags & 1);
+            lex->flags.mergelines    = !!(flags & 2);
+            lex->flags.noops         = !!(flags & 4);
+            ftepp->inc_lex = nullptr;
+            return lex_do(lex);
+        }
+
+        /* past the end keeps giving the final TOKEN_EOF, like the lexer */
+        tok = &inc->tokens[ftepp->inc_at];
+        if (ftepp->inc_at + 1 < vec_size(inc->tokens))
+            ftepp->inc_at++;
+
+        if (lex->tok.value)
+            vec_shrinkto(lex->tok.value, 0);
+        vec_append(lex->tok.value, tok->length + 1, inc->values + tok->value);
+        vec_shrinkby(lex->tok.value, 1);
+        lex->tok.ttype       = tok->ttype;
+        lex->tok.constval    = tok->constval;
+        lex->tok.ctx.file    = lex->name;
+        lex->tok.ctx.line    = tok->ctxline;
+        lex->tok.ctx.column  = tok->ctxcolumn;
+        lex->line            = tok->line;
+        lex->sline           = tok->sline;
+        lex->column          = tok->column;
+        lex->eof             = tok->eof;
+        return tok->ttype;
+    }
+
+    /* files the lexer complains about are not cached, so the diagnostics
+     * are repeated on every include just like before
+     */
+    warnings = compile_warnings;
+    errors   = compile_errors;
+    (void)lex_do(lex);
+    if (warnings != compile_warnings || errors != compile_errors || lex->tok.ttype >= TOKEN_ERROR) {
+        inc->failed    = true;
+        ftepp->inc_lex = nullptr;
+        return lex->tok.ttype;
+    }
+
+    tok = vec_add(inc->tokens, 1);
+    tok->ttype     = lex->tok.ttype;
+    tok->flags     = flags;
+    tok->value     = vec_size(inc->values);
+    tok->length    = vec_size(lex->tok.value);
+    tok->constval  = lex->tok.constval;
+    tok->ctxline   = lex->tok.ctx.line;
+    tok->ctxcolumn = lex->tok.ctx.column;
+    tok->line      = lex->line;
+    tok->sline     = lex->sline;
+    tok->column    = lex->column;
+    tok->eof       = lex->eof;
+    vec_append(inc->values, tok->length, lex->tok.value);
+    vec_push(inc->values, 0);
+    return tok->ttype;
+}
+
 static GMQCC_INLINE int ftepp_next(ftepp_t *ftepp)
 {
+    if (ftepp->lex == ftepp->inc_lex)
+        return (ftepp->token = ftepp_include_next(ftepp));
     return (ftepp->token = lex_do(ftepp->lex));
 }
 
@@ -722,8 +970,9 @@ static bool ftepp_preprocess(ftepp_t *ftepp);
 static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *params, bool resetline)
 {
     char     *buffer       = nullptr;
-    char     *old_string   = ftepp->output_string;
-    char     *inner_string;
+    ppoutput  old_output   = ftepp->output;
+    ppoutput  body;
+    ppoutput  inner;
     lex_file *old_lexer    = ftepp->lex;
     size_t    vararg_start = vec_size(macro->params);
     bool      retval       = true;
@@ -747,15 +996,16 @@ static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *param
     if (!vec_size(macro->output))
         return true;
 
-    ftepp->output_string = nullptr;
+    memset(&ftepp->output, 0, sizeof(ftepp->output));
+    memset(&body, 0, sizeof(body));
     for (o = 0; o < vec_size(macro->output); ++o) {
         pptoken *out = macro->output[o];
         switch (out->token) {
             case TOKEN_VA_ARGS:
                 if (!macro->variadic) {
                     ftepp_error(ftepp, "internal preprocessor error: TOKEN_VA_ARGS in non-variadic macro");
-                    vec_free(old_string);
-                    return false;
+                    retval = false;
+                    goto cleanup;
                 }
                 if (!varargs)
                     break;
@@ -771,8 +1021,8 @@ static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *param
             case TOKEN_VA_ARGS_ARRAY:
                 if ((size_t)out->constval.i >= varargs) {
                     ftepp_error(ftepp, "subscript of `[%u]` is out of bounds for `__VA_ARGS__`", out->constval.i);
-                    vec_free(old_string);
-                    return false;
+                    retval = false;
+                    goto cleanup;
                 }
 
                 ftepp_param_out(ftepp, &params[out->constval.i + vararg_start]);
@@ -831,12 +1081,10 @@ static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *param
                 break;
         }
     }
-    vec_push(ftepp->output_string, 0);
-    /* Now run the preprocessor recursively on this string buffer */
-    /*
-    printf("__________\n%s\n=========\n", ftepp->output_string);
-    */
-    inlex = lex_open_string(ftepp->output_string, vec_size(ftepp->output_string)-1, ftepp->lex->name);
+    body = ftepp->output;
+    memset(&ftepp->output, 0, sizeof(ftepp->output));
+    /* Now run the preprocessor recursively on this output */
+    inlex = lex_open_segments(body.segments, vec_size(body.segments), ftepp->lex->name);
     if (!inlex) {
         ftepp_error(ftepp, "internal error: failed to instantiate lexer");
         retval = false;
@@ -849,29 +1097,24 @@ static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *param
 
     old_inmacro     = ftepp->in_macro;
     ftepp->in_macro = true;
-    ftepp->output_string = nullptr;
     if (!ftepp_preprocess(ftepp)) {
         ftepp->in_macro = old_inmacro;
-        vec_free(ftepp->lex->open_string);
-        vec_free(ftepp->output_string);
         lex_close(ftepp->lex);
         retval = false;
         goto cleanup;
     }
     ftepp->in_macro = old_inmacro;
-    vec_free(ftepp->lex->open_string);
     lex_close(ftepp->lex);
 
-    inner_string = ftepp->output_string;
-    ftepp->output_string = old_string;
+    inner         = ftepp->output;
+    ftepp->output = old_output;
 
-    has_newlines = (strchr(inner_string, '\n') != nullptr);
+    has_newlines = ppoutput_haschr(&inner, '\n');
 
     if (has_newlines && !old_inmacro)
         ftepp_recursion_header(ftepp);
 
-    vec_append(ftepp->output_string, vec_size(inner_string), inner_string);
-    vec_free(inner_string);
+    ppoutput_take(&ftepp->output, &inner);
 
     if (has_newlines && !old_inmacro)
         ftepp_recursion_footer(ftepp);
@@ -882,10 +1125,13 @@ static bool ftepp_macro_expand(ftepp_t *ftepp, ppmacro *macro, macroparam *param
         ftepp_out(ftepp, lineno, false);
     }
 
-    old_string = ftepp->output_string;
+    old_output = ftepp->output;
+    memset(&ftepp->output, 0, sizeof(ftepp->output));
 cleanup:
-    ftepp->lex           = old_lexer;
-    ftepp->output_string = old_string;
+    ppoutput_free(&body);
+    ppoutput_free(&ftepp->output);
+    ftepp->lex    = old_lexer;
+    ftepp->output = old_output;
     return retval;
 }
 
@@ -1414,6 +1660,68 @@ static void ftepp_directive_message(ftepp_t *ftepp) {
     con_cprintmsg(ftepp->lex->tok.ctx, LVL_MSG, "message",  ftepp_tokval(ftepp));
 }
 
+/*
+ * Find the include guard of a recorded file: the whole file, but for
+ * whitespace, is one `#ifndef GUARD ... #endif`. Including it again while
+ * GUARD is defined does nothing, so the file is not read at all then.
+ */
+static char *ftepp_include_guard(ppinclude *inc)
+{
+    const char *guard   = nullptr;
+    bool        newline = true;
+    size_t      depth   = 0;
+    size_t      i, n    = vec_size(inc->tokens);
+
+    for (i = 0; i < n; ++i) {
+        ppinctoken *tok = &inc->tokens[i];
+        const char *directive;
+
+        if (tok->ttype == TOKEN_WHITE || tok->ttype == TOKEN_EOF)
+            continue;
+        if (tok->ttype == TOKEN_EOL) {
+            newline = true;
+            continue;
+        }
+        if (tok->ttype != '#' || !newline) {
+            /* other tokens only inside of the guard */
+            if (!depth)
+                return nullptr;
+            newline = false;
+            continue;
+        }
+        newline = false;
+        /* no directives after it either */
+        if (guard && !depth)
+            return nullptr;
+
+        /* the directive name follows the # */
+        while (++i < n && inc->tokens[i].ttype == TOKEN_WHITE)
+            ;
+        if (i == n)
+            return nullptr;
+        directive = inc->values + inc->tokens[i].value;
+
+        if (!guard) {
+            /* #ifndef GUARD */
+            if (strcmp(directive, "ifndef"))
+                return nullptr;
+            while (++i < n && inc->tokens[i].ttype == TOKEN_WHITE)
+                ;
+            if (i == n || inc->tokens[i].ttype != TOKEN_IDENT)
+                return nullptr;
+            guard = inc->values + inc->tokens[i].value;
+            depth = 1;
+        }
+        else if (!strcmp(directive, "if") || !strcmp(directive, "ifdef") || !strcmp(directive, "ifndef"))
+            depth++;
+        else if (!strcmp(directive, "endif"))
+            depth--;
+        else if (depth == 1 && !strncmp(directive, "el", 2))
+            return nullptr;
+    }
+    return (guard && !depth) ? util_strdup(guard) : nullptr;
+}
+
 /**
  * Include a file.
  * FIXME: do we need/want a -I option?
@@ -1428,6 +1736,15 @@ static bool ftepp_include(ftepp_t *ftepp)
     char     *filename;
     char     *parsename = nullptr;
     char     *old_includename;
+    struct stat st;
+    ppinclude *inc;
+    bool       cached;
+
+    /* the include cache state of the including file */
+    lex_file  *old_inc_lex;
+    ppinclude *old_inc;
+    size_t     old_inc_at;
+    bool       old_inc_replay;
 
     (void)ftepp_next(ftepp);
     if (!ftepp_skipspace(ftepp))
@@ -1436,14 +1753,14 @@ static bool ftepp_include(ftepp_t *ftepp)
     if (ftepp->token != TOKEN_STRINGCONST) {
         ppmacro *macro = ftepp_macro_find(ftepp, ftepp_tokval(ftepp));
         if (macro) {
-            char *backup = ftepp->output_string;
-            ftepp->output_string = nullptr;
+            ppoutput backup = ftepp->output;
+            memset(&ftepp->output, 0, sizeof(ftepp->output));
             if (ftepp_macro_expand(ftepp, macro, nullptr, true)) {
-                parsename = util_strdup(ftepp->output_string);
-                vec_free(ftepp->output_string);
-                ftepp->output_string = backup;
+                parsename = ppoutput_strdup(&ftepp->output);
+                ppoutput_free(&ftepp->output);
+                ftepp->output = backup;
             } else {
-                ftepp->output_string = backup;
+                ftepp->output = backup;
                 ftepp_error(ftepp, "expected filename to include");
                 return false;
             }
@@ -1484,27 +1801,88 @@ static bool ftepp_include(ftepp_t *ftepp)
         return false;
     }
     mem_d(parsename);
+
+    /* a cached file is only used while it is unchanged */
+    inc = (ppinclude*)util_htget(ftepp->includes, filename);
+    if (inc && (stat(filename, &st) || st.st_mtime != inc->mtime || st.st_size != inc->size)) {
+        if (!inc->users)
+            util_htrm(ftepp->includes, filename, (void (*)(void*))&ppinclude_delete);
+        inc = nullptr;
+    }
+
+    if (inc && inc->guard && ftepp_macro_find(ftepp, inc->guard)) {
+        vec_free(filename);
+        goto included;
+    }
+
     inlex = lex_open(filename);
     if (!inlex) {
         ftepp_error(ftepp, "open failed on include file `%s`", filename);
         vec_free(filename);
         return false;
     }
+
+    old_inc_lex    = ftepp->inc_lex;
+    old_inc        = ftepp->inc;
+    old_inc_at     = ftepp->inc_at;
+    old_inc_replay = ftepp->inc_replay;
+
+    cached = !!inc;
+    if (cached)
+        inc->users++;
+    else if (!stat(filename, &st))
+        inc = ppinclude_new(&st);
+    ftepp->inc_lex    = inc ? inlex : nullptr;
+    ftepp->inc        = inc;
+    ftepp->inc_at     = 0;
+    ftepp->inc_replay = cached;
+
     ftepp->lex = inlex;
     old_includename = ftepp->includename;
     ftepp->includename = filename;
     if (!ftepp_preprocess(ftepp)) {
+        if (cached)
+            inc->users--;
+        else if (inc)
+            ppinclude_delete(inc);
+        ftepp->inc_lex    = old_inc_lex;
+        ftepp->inc        = old_inc;
+        ftepp->inc_at     = old_inc_at;
+        ftepp->inc_replay = old_inc_replay;
         vec_free(ftepp->includename);
         ftepp->includename = old_includename;
         lex_close(ftepp->lex);
         ftepp->lex = old_lexer;
         return false;
     }
+
+    /* keep a complete recording, unless the file has been cached in the
+     * meantime (by including itself) and that one is in use
+     */
+    if (cached)
+        inc->users--;
+    else if (inc) {
+        ppinclude *old = (ppinclude*)util_htget(ftepp->includes, filename);
+        if (inc->failed || (old && old->users))
+            ppinclude_delete(inc);
+        else {
+            if (old)
+                util_htrm(ftepp->includes, filename, (void (*)(void*))&ppinclude_delete);
+            inc->guard = ftepp_include_guard(inc);
+            util_htset(ftepp->includes, filename, inc);
+        }
+    }
+    ftepp->inc_lex    = old_inc_lex;
+    ftepp->inc        = old_inc;
+    ftepp->inc_at     = old_inc_at;
+    ftepp->inc_replay = old_inc_replay;
+
     vec_free(ftepp->includename);
     ftepp->includename = old_includename;
     lex_close(ftepp->lex);
     ftepp->lex = old_lexer;
 
+included:
     ftepp_out(ftepp, "\n#pragma file(", false);
     ftepp_out(ftepp, ctx.file, false);
     util_snprintf(lineno, sizeof(lineno), ")\n#pragma line(%lu)\n", (unsigned long)(ctx.line+1));
@@ -1783,10 +2161,6 @@ static bool ftepp_preprocess(ftepp_t *ftepp)
         }
     } while (!ftepp->errors && ftepp->token < TOKEN_EOF);
 
-    /* force a 0 at the end but don't count it as added to the output */
-    vec_push(ftepp->output_string, 0);
-    vec_shrinkby(ftepp->output_string, 1);
-
     return (ftepp->token == TOKEN_EOF);
 }
 
@@ -1929,9 +2303,10 @@ void ftepp_add_define(ftepp_t *ftepp, const char *source, const char *name)
     util_htset(ftepp->macros, name, macro);
 }
 
-const char *ftepp_get(ftepp_t *ftepp)
+const lex_segment *ftepp_get(ftepp_t *ftepp, size_t *count)
 {
-    return ftepp->output_string;
+    *count = vec_size(ftepp->output.segments);
+    return ftepp->output.segments;
 }
 
 void ftepp_flush(ftepp_t *ftepp)
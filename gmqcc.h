@@ -203,6 +203,8 @@ const struct tm *util_localtime(const time_t *timer);
 const char      *util_ctime    (const time_t *timer);
 
 bool             util_isatty(FILE *);
+void            *util_mapfile  (const char *filename, size_t *size);
+void             util_unmapfile(void *data, size_t size);
 size_t           hash(const char *key);
 
 /*
@@ -245,9 +247,11 @@ void _util_vec_delete(void *vec);
 typedef struct hash_table_s {
     size_t                size;
     struct hash_node_t **table;
+    bool                  interned; /* keys are util_intern strings */
 } hash_table_t, *ht;
 
 hash_table_t *util_htnew (size_t size);
+hash_table_t *util_htnewinterned(size_t size);
 void util_htrem(hash_table_t *ht, void (*callback)(void *data));
 void util_htset(hash_table_t *ht, const char *key, void *value);
 void util_htdel(hash_table_t *ht);
@@ -257,6 +261,10 @@ void util_htrmh(hash_table_t *ht, const char *key, size_t bin, void (*cb)(void*)
 void util_htrm(hash_table_t *ht, const char *key, void (*cb)(void*));
 void *util_htget(hash_table_t *ht, const char *key);
 void *util_htgeth(hash_table_t *ht, const char *key, size_t hash);
+
+const char *util_intern(const char *str);
+size_t      util_internhash(const char *interned);
+void        util_interncleanup(void);
 int util_snprintf(char *str, size_t, const char *fmt, ...);
 int util_getline(char  **, size_t *, FILE *);
 
@@ -667,46 +675,317 @@ enum {
 };
 
 #define VM_JUMPS_DEFAULT 1000000
+#define VM_GOTOS_DEFAULT 10000000
+
+/*
+ * Limits for prog_exec_budget, 0 for no limit.  Backward IF and IFNOT
+ * jumps, which close do loops, count against jumps, and backward GOTOs,
+ * which close while and for loops, against gotos.  Forward jumps are not
+ * counted.  The other limits are only checked on backward jumps and calls.  Statements are charged in the stretches
+ * between those: all the statements from where execution entered a
+ * stretch to where it left it, skipped ones included.  Time is checked
+ * every VM_BUDGET_CLOCK_STATEMENTS charged statements.
+ */
+struct qc_exec_budget_t {
+    long     jumps;       /* backward IF and IFNOT jumps    */
+    long     gotos;       /* backward GOTOs                 */
+    uint64_t statements;
+    uint64_t nanoseconds; /* wall time, on a monotonic clock */
+};
+
+#define VM_BUDGET_CLOCK_STATEMENTS 65536
+
+/*
+ * A binary log of what prog_exec runs, see prog_trace_record.  It holds
+ * the statements executed, delta encoded, and what builtins were passed
+ * and returned, so a replay runs the same way without the host.
+ */
+struct qc_exec_tracelog_t {
+    FILE    *file;   /* the log being written                              */
+    uint8_t *data;   /* output not written yet, or all of the replayed log */
+    size_t   at;     /* replaying: where the next event is read            */
+    bool     replay;
+    bool     failed;
+    size_t   last;   /* the statement which ran last                       */
+    size_t   run;    /* statements run after last, or left to replay       */
+};
+
+/*
+ * Temp strings are handed out as negative string numbers holding an offset
+ * into the temp string ring and the generation of the ring it was written
+ * in, see prog_tempstring.
+ */
+#define VM_TEMPSTRING_BITS 16
+#define VM_TEMPSTRING_SIZE (1 << VM_TEMPSTRING_BITS)
+#define VM_TEMPSTRING_GENS (1 << (31 - VM_TEMPSTRING_BITS))
 
 /* execute-flags */
-#define VMXF_DEFAULT 0x0000     /* default flags - nothing */
-#define VMXF_TRACE   0x0001     /* trace: print statements before executing */
-#define VMXF_PROFILE 0x0002     /* profile: increment the profile counters */
+#define VMXF_DEFAULT    0x0000  /* default flags - nothing */
+#define VMXF_TRACE      0x0001  /* trace: print statements before executing */
+#define VMXF_PROFILE    0x0002  /* profile: count statements and calls per call path */
+#define VMXF_THREADED   0x0004  /* threaded: computed-goto dispatch if available */
+#define VMXF_LAZYLOCALS 0x0008  /* lazylocals: only back up locals callers still use */
+
+/* load-flags */
+#define VMLF_DEFAULT    0x0000  /* default flags - nothing */
+#define VMLF_COLUMNS    0x0001  /* columns: store entity fields column by column */
+#define VMLF_MMAP       0x0002  /* mmap: use the file's sections in place if possible */
+
+/* entity reuse order of spawn, pick it before spawning anything */
+#define VMENT_REUSE_LOWEST 0    /* the free entity with the lowest number */
+#define VMENT_REUSE_LIFO   1    /* the most recently freed entity         */
+#define VMENT_REUSE_FIFO   2    /* the least recently freed entity        */
+
+/* entity data grows by this many entities at once */
+#define VM_ENTITY_CHUNK 64
 
 struct qc_program_t;
 typedef int (*prog_builtin_t)(qc_program_t *prog);
 
+/*
+ * A builtin for prog_register_builtins: it is bound to `number`, or when
+ * that is 0, to whichever number the progs declared the builtin `name` as.
+ */
+struct prog_builtin_def_t {
+    const char     *name;
+    qcint_t         number;
+    prog_builtin_t  func;
+};
+
 struct qc_exec_stack_t {
     qcint_t stmt;
     size_t localsp;
+    size_t localsfirst; /* first global backed up at localsp */
+    size_t profnode;    /* the caller's profile node */
     prog_section_function_t *function;
 };
 
+/*
+ * With VMXF_PROFILE every call path gets a node, node 0 being the host
+ * calling into the program.  Children are created after their parents so
+ * they always have a higher index.
+ */
+struct qc_exec_profnode_t {
+    qcint_t  function;
+    size_t   parent;
+    size_t   child;   /* first child, 0 when there is none */
+    size_t   next;    /* next child of the parent          */
+    size_t   calls;
+    size_t   self;    /* statements executed on this path */
+    uint64_t time;    /* nanoseconds spent in it, including children */
+    uint64_t entered;
+};
+
+/* allocation counters of a program, the VM never resets them */
+struct qc_exec_stats_t {
+    size_t spawned;       /* entities spawned           */
+    size_t reused;        /* ... of which were reused   */
+    size_t freed;         /* entities freed             */
+    size_t entitygrowths; /* times entity data grew     */
+    size_t tempstrings;   /* temp strings made          */
+    size_t tempbytes;     /* ... and their bytes        */
+    size_t tempwraps;     /* times the ring wrapped     */
+};
+
+/*
+ * Per function data computed by prog_load.  With VMXF_LAZYLOCALS only
+ * the locals in [firstlocal+savefirst, firstlocal+savefirst+savecount)
+ * are backed up on a call: those are the ones which can still be in use
+ * by a function further down the stack, be it the same function through
+ * recursion, or another one sharing its locals.
+ *
+ * The parameters are copied by a plan: either one of the common shapes,
+ * or runs of parameter globals which are next to each other, each copied
+ * at once.
+ */
+struct qc_exec_function_t {
+    uint32_t savefirst;
+    uint32_t savecount;
+    uint16_t params;    /* the shape of the parameters, QCVM_PARAMS_* in exec.cpp */
+    uint16_t paramruns;
+    struct {
+        uint16_t from;  /* global after OFS_PARM0 */
+        uint16_t count;
+    } paramrun[8];
+};
+
+/*
+ * prog_load translates the statements into this form, one per statement
+ * so statement numbers stay the same.  Operands are resolved to pointers
+ * into the globals and checks which can be proven at load time are gone
+ * by picking an unchecked variant of the opcode.  The code section is
+ * left untouched and only used for tracing and disassembly.
+ *
+ * fused is what the loops without tracing or profiling dispatch on: when
+ * a statement starts a common pair it names an opcode which executes both
+ * statements at once, otherwise it is the same as opcode.  The second
+ * statement of a pair is kept as it is, so jumping to it still works.
+ */
+struct qc_exec_callcache_t;
+struct qc_exec_statement_t {
+    uint16_t  opcode; /* INSTR_* or one of the VM internal opcodes   */
+    uint16_t  fused;  /* opcode, or a fused opcode for this and the next */
+    int32_t   imm;    /* jump offset for IF/IFNOT/GOTO, argc for CALL */
+    qcany_t  *a;
+    qcany_t  *b;
+    union {
+        qcany_t             *c;
+        qc_exec_callcache_t *call; /* CALLs have no third operand */
+    };
+};
+
+/*
+ * The function a CALL statement called last.  As long as the function
+ * global still holds the same number, the call skips checking it and
+ * looking up the builtin.  Empty when function is 0.
+ */
+struct qc_exec_callcache_t {
+    qcint_t                  function;
+    prog_section_function_t *target;
+    prog_builtin_t           builtin; /* nullptr for QC functions */
+};
+
+/*
+ * A read-only section of a program: a copy read from the file, or with
+ * VMLF_MMAP the section in the mapped file itself.
+ */
+template <typename T>
+struct qc_section_t {
+    T             *m_data;
+    size_t         m_size;
+    std::vector<T> m_copy;
+
+    size_t size() const { return m_size; }
+    T &operator[](size_t i) { return m_data[i]; }
+    const T &operator[](size_t i) const { return m_data[i]; }
+    T *begin() { return m_data; }
+    T *end() { return m_data + m_size; }
+
+    void resize(size_t n) {
+        m_copy.resize(n);
+        m_data = m_copy.data();
+        m_size = n;
+    }
+    void map(T *data, size_t n) {
+        m_copy.clear();
+        m_data = data;
+        m_size = n;
+    }
+};
+
+/*
+ * Snapshots keep the state in blocks of VM_SNAPSHOT_BLOCK values, and a
+ * block which didn't change since the previous snapshot is shared with
+ * it.  Changes to the entity data and the temp strings are tracked with
+ * dirty bits per block, the globals are compared when taking a snapshot,
+ * as nearly every instruction writes them.  See prog_snapshot.
+ */
+#define VM_SNAPSHOT_BLOCK 256
+
+struct qc_snapshot_block_t {
+    size_t  refs;
+    qcint_t data[VM_SNAPSHOT_BLOCK];
+};
+
+struct qc_snapshot_t {
+    size_t refs; /* the host's, and the program's while it is its base */
+
+    size_t                globalcount;
+    qc_snapshot_block_t **globals;
+    size_t                entityfields;
+    bool                  entitycolumns;
+    size_t                entitycount; /* values in the entity data */
+    qc_snapshot_block_t **entitydata;
+    qc_snapshot_block_t **tempstrings;
+
+    bool     *entitypool;
+    uint32_t *entityfree;
+    qcint_t  *entityfreelist;
+    qcint_t   entities;
+    size_t    entitycapacity;
+    size_t    entitystride;
+    size_t    fieldstride;
+    size_t    entityfreeword;
+    size_t    entityfreecount;
+    size_t    entityfreehead;
+    size_t    tempstring_at;
+    size_t    tempstring_prevend;
+    uint32_t  tempstring_gen;
+};
+
 struct qc_program_t {
     char *filename;
-    std::vector<prog_section_statement_t> code;
-    std::vector<prog_section_def_t> defs;
-    std::vector<prog_section_def_t> fields;
-    std::vector<prog_section_function_t> functions;
-    std::vector<char> strings;
+    void  *mapping;     /* the file with VMLF_MMAP, sections may point into it */
+    size_t mappingsize;
+    qc_section_t<prog_section_statement_t> code;
+    qc_section_t<prog_section_def_t> defs;
+    qc_section_t<prog_section_def_t> fields;
+    qc_section_t<prog_section_function_t> functions;
+    qc_section_t<char> strings;
     std::vector<qcint_t> globals;
+    qc_exec_statement_t *decoded;
+    qc_exec_callcache_t *callcaches; /* one per CALL statement, see prog_decode */
+    qc_exec_function_t  *funcinfo;
+    /*
+     * Field f of entity e is at entitydata[e*entitystride + f*fieldstride].
+     * Rows (the default) keep an entity's fields together, with VMLF_COLUMNS
+     * the same field of all entities is. Pointers from ADDRESS are always
+     * e*entityfields + f.
+     */
     qcint_t *entitydata;
+    size_t   entitycapacity; /* entities there is room for in entitydata */
+    size_t   entitystride;
+    size_t   fieldstride;
+    bool     entitycolumns;
     bool *entitypool;
 
+    /* free entities, see prog_spawn_entity */
+    uint32_t *entityfree;      /* bitmap, a set bit is a free entity        */
+    size_t    entityfreeword;  /* the words before this one have no free bit */
+    size_t    entityfreecount;
+    qcint_t  *entityfreelist;  /* freed entities in order, for LIFO/FIFO    */
+    size_t    entityfreehead;  /* next one to take for FIFO                 */
+    int       entityreuse;     /* VMENT_REUSE_*                             */
+
     const char* *function_stack;
 
     uint16_t crc16;
 
-    size_t tempstring_start;
-    size_t tempstring_at;
+    char    *tempstrings;        /* VM_TEMPSTRING_SIZE bytes, never moved      */
+    size_t   tempstring_at;
+    size_t   tempstring_prevend;  /* end of the previous generation's strings  */
+    uint32_t tempstring_gen;
+
+    /* what changed since snapbase was taken or restored, see prog_snapshot */
+    qc_snapshot_t *snapbase;
+    uint32_t      *entitydirty;   /* a bit per block of the entity data */
+    uint64_t       tempdirty;     /* a bit per block of the temp strings */
 
     qcint_t  vmerror;
+    char    *errortrace; /* the QC stack where prog_exec last failed, a string */
+    qc_exec_tracelog_t *tracelog; /* see prog_trace_record */
 
     size_t *profile;
+    qc_exec_profnode_t *profnodes;
+    size_t              profnode;  /* the node of the running function */
+    int32_t            *linenums;  /* from the .lno file, see prog_load_lno */
 
-    prog_builtin_t *builtins;
+    prog_builtin_t *builtins;       /* see prog_register_builtins */
     size_t          builtins_count;
 
+    void *userdata; /* for the host, the VM does not touch it */
+
+    /*
+     * Lookups built at load time, see prog_index.  They hold an index + 1
+     * into defs, fields or functions, 0 when there is none.  By offset the
+     * first def wins, by name the last one.
+     */
+    uint32_t     *defbyoffset;
+    uint32_t     *fieldbyoffset;
+    hash_table_t *defbyname;
+    hash_table_t *fieldbyname;
+    hash_table_t *functionbyname;
+
     /* size_t ip; */
     qcint_t  entities;
     size_t entityfields;
@@ -732,24 +1011,52 @@ struct qc_program_t {
         qcint_t time;
     } cached_globals;
 
+    qc_exec_stats_t stats;
+
     bool supports_state; /* is INSTR_STATE supported? */
 };
 
-qc_program_t*       prog_load      (const char *filename, bool ignoreversion);
+qc_program_t*       prog_load      (const char *filename, bool ignoreversion, size_t lflags);
 void                prog_delete    (qc_program_t *prog);
+qc_program_t*       prog_clone     (qc_program_t *prog);
+void                prog_copy_state(qc_program_t *dst, qc_program_t *src);
+qc_program_t*       prog_reload    (qc_program_t *prog, const char *filename, size_t lflags);
 bool                prog_exec      (qc_program_t *prog, prog_section_function_t *func, size_t flags, long maxjumps);
+bool                prog_exec_budget(qc_program_t *prog, prog_section_function_t *func, size_t flags, const qc_exec_budget_t *budget);
+bool                prog_trace_record(qc_program_t *prog, const char *filename);
+bool                prog_trace_replay(qc_program_t *prog, const char *filename);
+bool                prog_trace_end (qc_program_t *prog);
 const char*         prog_getstring (qc_program_t *prog, qcint_t str);
 prog_section_def_t* prog_entfield  (qc_program_t *prog, qcint_t off);
 prog_section_def_t* prog_getdef    (qc_program_t *prog, qcint_t off);
+prog_section_def_t* prog_find_global(qc_program_t *prog, const char *name);
+prog_section_def_t* prog_find_field (qc_program_t *prog, const char *name);
+prog_section_function_t* prog_find_function(qc_program_t *prog, const char *name);
 qcany_t*            prog_getedict  (qc_program_t *prog, qcint_t e);
+qcany_t*            prog_edictfield(qc_program_t *prog, qcint_t e, qcint_t field);
 qcint_t             prog_tempstring(qc_program_t *prog, const char *_str);
-
+void                prog_tempstring_reset(qc_program_t *prog);
+qc_snapshot_t*      prog_snapshot  (qc_program_t *prog);
+bool                prog_restore   (qc_program_t *prog, qc_snapshot_t *snap);
+void                prog_snapshot_delete(qc_snapshot_t *snap);
+size_t              prog_register_builtins(qc_program_t *prog, const prog_builtin_def_t *defs, size_t count);
+bool                prog_load_lno  (qc_program_t *prog, const char *filename);
+void                prog_profile_report    (qc_program_t *prog, FILE *out, bool times);
+void                prog_profile_flamegraph(qc_program_t *prog, FILE *out);
+
+
+/* a piece of source text, see lex_open_segments */
+struct lex_segment {
+    const char *data;
+    size_t      length;
+};
 
 /* parser.c */
 struct parser_t;
 parser_t *parser_create(void);
 bool parser_compile_file(parser_t *parser, const char *);
 bool parser_compile_string(parser_t *parser, const char *, const char *, size_t);
+bool parser_compile_segments(parser_t *parser, const char *, const lex_segment *, size_t);
 bool parser_finish(parser_t *parser, const char *);
 void parser_cleanup(parser_t *parser);
 
@@ -759,7 +1066,7 @@ ftepp_t *ftepp_create           (void);
 bool ftepp_preprocess_file  (ftepp_t *ftepp, const char *filename);
 bool ftepp_preprocess_string(ftepp_t *ftepp, const char *name, const char *str);
 void ftepp_finish(ftepp_t *ftepp);
-const char *ftepp_get(ftepp_t *ftepp);
+const lex_segment *ftepp_get(ftepp_t *ftepp, size_t *count);
 void ftepp_flush(ftepp_t *ftepp);
 void ftepp_add_define(ftepp_t *ftepp, const char *source, const char *name);
 void ftepp_add_macro(ftepp_t *ftepp, const char *name,   const char *value);
@@ -116,9 +116,9 @@ ir_builder::ir_builder(const std::string& modulename)
 : m_name(modulename),
   m_code(new code_t)
 {
-    m_htglobals   = util_htnew(IR_HT_SIZE);
-    m_htfields    = util_htnew(IR_HT_SIZE);
-    m_htfunctions = util_htnew(IR_HT_SIZE);
+    m_htglobals   = util_htnewinterned(IR_HT_SIZE);
+    m_htfields    = util_htnewinterned(IR_HT_SIZE);
+    m_htfunctions = util_htnewinterned(IR_HT_SIZE);
 
     m_nil = new ir_value("nil", store_value, TYPE_NIL);
     m_nil->m_cvq = CV_CONST;
@@ -154,14 +154,15 @@ ir_builder::~ir_builder()
 
 ir_function* ir_builder::createFunction(const std::string& name, qc_type outtype)
 {
-    ir_function *fn = (ir_function*)util_htget(m_htfunctions, name.c_str());
+    const char  *key = util_intern(name.c_str());
+    ir_function *fn  = (ir_function*)util_htget(m_htfunctions, key);
     if (fn)
         return nullptr;
 
     fn = new ir_function(this, outtype);
     fn->m_name = name;
     m_functions.emplace_back(fn);
-    util_htset(m_htfunctions, name.c_str(), fn);
+    util_htset(m_htfunctions, key, fn);
 
     fn->m_value = createGlobal(fn->m_name, TYPE_FUNCTION);
     if (!fn->m_value) {
@@ -179,11 +180,12 @@ ir_function* ir_builder::createFunction(const std::string& name, qc_type outtype
 
 ir_value* ir_builder::createGlobal(const std::string& name, qc_type vtype)
 {
-    ir_value *ve;
+    const char *key = util_intern(name.c_str());
+    ir_value   *ve;
 
     if (name[0] != '#')
     {
-        ve = (ir_value*)util_htget(m_htglobals, name.c_str());
+        ve = (ir_value*)util_htget(m_htglobals, key);
         if (ve) {
             return nullptr;
         }
@@ -191,7 +193,7 @@ ir_value* ir_builder::createGlobal(const std::string& name, qc_type vtype)
 
     ve = new ir_value(std::string(name), store_global, vtype);
     m_globals.emplace_back(ve);
-    util_htset(m_htglobals, name.c_str(), ve);
+    util_htset(m_htglobals, key, ve);
     return ve;
 }
 
@@ -204,7 +206,8 @@ ir_value* ir_builder::get_va_count()
 
 ir_value* ir_builder::createField(const std::string& name, qc_type vtype)
 {
-    ir_value *ve = (ir_value*)util_htget(m_htfields, name.c_str());
+    const char *key = util_intern(name.c_str());
+    ir_value   *ve  = (ir_value*)util_htget(m_htfields, key);
     if (ve) {
         return nullptr;
     }
@@ -212,7 +215,7 @@ ir_value* ir_builder::createField(const std::string& name, qc_type vtype)
     ve = new ir_value(std::string(name), store_global, TYPE_FIELD);
     ve->m_fieldtype = vtype;
     m_fields.emplace_back(ve);
-    util_htset(m_htfields, name.c_str(), ve);
+    util_htset(m_htfields, key, ve);
     return ve;
 }
 
@@ -2829,7 +2832,7 @@ qcint_t ir_builder::filestring(const char *filename)
 
     for (size_t i = 0; i != m_filenames.size(); ++i) {
         if (!strcmp(m_filenames[i], filename))
-            return i;
+            return m_filestrings[i];
     }
 
     str = code_genstring(m_code.get(), filename);
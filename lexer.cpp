@@ -6,27 +6,132 @@
 
 /*
  * List of Keywords
+ * Identifiers which lex as something else: the builtin typenames, the
+ * _length operator and the keywords. The ones marked fg only exist for
+ * fte/gmqcc and are plain identifiers with -std=qcc.
  */
+struct lex_word {
+    const char *name;
+    int         ttype;
+    qc_type     type;  /* for TOKEN_TYPENAME */
+    bool        fg;
+};
+
+enum {
+    WORD_VOID, WORD_INT, WORD_FLOAT, WORD_BOOL, WORD_STRING, WORD_ENTITY,
+    WORD_VECTOR, WORD_LENGTH,
+
+    /* original */
+    WORD_FOR, WORD_DO, WORD_WHILE, WORD_IF, WORD_ELSE, WORD_LOCAL,
+    WORD_RETURN, WORD_CONST,
 
-/* original */
-static const char *keywords_qc[] = {
-    "for", "do", "while",
-    "if", "else",
-    "local",
-    "return",
-    "const"
+    /* For fte/gmqcc */
+    WORD_SWITCH, WORD_CASE, WORD_DEFAULT, WORD_STRUCT, WORD_UNION,
+    WORD_BREAK, WORD_CONTINUE, WORD_TYPEDEF, WORD_GOTO, WORD_PRINTTYPE
 };
-/* For fte/gmgqcc */
-static const char *keywords_fg[] = {
-    "switch", "case", "default",
-    "struct", "union",
-    "break", "continue",
-    "typedef",
-    "goto",
-
-    "__builtin_debug_printtype"
+
+static const lex_word lex_words[] = {
+    { "void",     TOKEN_TYPENAME, TYPE_VOID,    false },
+    { "int",      TOKEN_TYPENAME, TYPE_INTEGER, false },
+    { "float",    TOKEN_TYPENAME, TYPE_FLOAT,   false },
+    { "bool",     TOKEN_TYPENAME, TYPE_BOOL,    false },
+    { "string",   TOKEN_TYPENAME, TYPE_STRING,  false },
+    { "entity",   TOKEN_TYPENAME, TYPE_ENTITY,  false },
+    { "vector",   TOKEN_TYPENAME, TYPE_VECTOR,  false },
+    { "_length",  TOKEN_OPERATOR, TYPE_VOID,    false },
+
+    { "for",      TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "do",       TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "while",    TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "if",       TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "else",     TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "local",    TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "return",   TOKEN_KEYWORD,  TYPE_VOID,    false },
+    { "const",    TOKEN_KEYWORD,  TYPE_VOID,    false },
+
+    { "switch",   TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "case",     TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "default",  TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "struct",   TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "union",    TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "break",    TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "continue", TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "typedef",  TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "goto",     TOKEN_KEYWORD,  TYPE_VOID,    true  },
+    { "__builtin_debug_printtype", TOKEN_KEYWORD, TYPE_VOID, true }
 };
 
+/* Find the only word an identifier could be, by its length and first
+ * (or last) character, so at most one comparison is done per identifier.
+ * When adding words keep every (length, character) pair unique.
+ */
+static const lex_word *lex_findword(const char *v, size_t len)
+{
+    int w = -1;
+
+    switch (len) {
+        case 2:
+            switch (v[0]) {
+                case 'd': w = WORD_DO; break;
+                case 'i': w = WORD_IF; break;
+            }
+            break;
+        case 3:
+            switch (v[0]) {
+                case 'f': w = WORD_FOR; break;
+                case 'i': w = WORD_INT; break;
+            }
+            break;
+        case 4:
+            switch (v[0]) {
+                case 'v': w = WORD_VOID; break;
+                case 'b': w = WORD_BOOL; break;
+                case 'e': w = WORD_ELSE; break;
+                case 'c': w = WORD_CASE; break;
+                case 'g': w = WORD_GOTO; break;
+            }
+            break;
+        case 5:
+            switch (v[0]) {
+                case 'f': w = WORD_FLOAT; break;
+                case 'w': w = WORD_WHILE; break;
+                case 'l': w = WORD_LOCAL; break;
+                case 'c': w = WORD_CONST; break;
+                case 'u': w = WORD_UNION; break;
+                case 'b': w = WORD_BREAK; break;
+            }
+            break;
+        case 6:
+            /* string, switch and struct share the first character */
+            switch (v[5]) {
+                case 'g': w = WORD_STRING; break;
+                case 'h': w = WORD_SWITCH; break;
+                case 't': w = WORD_STRUCT; break;
+                case 'y': w = WORD_ENTITY; break;
+                case 'r': w = WORD_VECTOR; break;
+                case 'n': w = WORD_RETURN; break;
+            }
+            break;
+        case 7:
+            switch (v[0]) {
+                case '_': w = WORD_LENGTH;  break;
+                case 'd': w = WORD_DEFAULT; break;
+                case 't': w = WORD_TYPEDEF; break;
+            }
+            break;
+        case 8:
+            w = WORD_CONTINUE;
+            break;
+        case 25:
+            w = WORD_PRINTTYPE;
+            break;
+    }
+
+    if (w < 0 || memcmp(v, lex_words[w].name, len))
+        return nullptr;
+    return &lex_words[w];
+}
+
 /*
  * Lexer code
  */
@@ -65,6 +170,7 @@ static void lex_token_new(lex_file *lex)
     if (lex->tok.value)
         vec_shrinkto(lex->tok.value, 0);
 
+    lex->tok.name        = nullptr;
     lex->tok.constval.t  = TYPE_VOID;
     lex->tok.ctx.line    = lex->sline;
     lex->tok.ctx.file    = lex->name;
@@ -74,45 +180,90 @@ static void lex_token_new(lex_file *lex)
 static void lex_ungetch(lex_file *lex, int ch);
 static int lex_getch(lex_file *lex);
 
+/* Read a whole file into memory, for when it cannot be mapped (an empty
+ * file, a pipe, or a platform without mmap).
+ */
+static char *lex_readfile(const char *file, size_t *size)
+{
+    FILE   *in = fopen(file, "rb");
+    char   *data = nullptr;
+    size_t  alloc = 0;
+    size_t  used = 0;
+    size_t  got;
+
+    if (!in)
+        return nullptr;
+
+    do {
+        if (used == alloc) {
+            char *grown;
+            alloc = alloc ? alloc * 2 : 4096;
+            grown = (char*)mem_r(data, alloc);
+            if (!grown) {
+                mem_d(data);
+                fclose(in);
+                return nullptr;
+            }
+            data = grown;
+        }
+        got   = fread(data + used, 1, alloc - used, in);
+        used += got;
+    } while (got);
+
+    if (ferror(in)) {
+        mem_d(data);
+        fclose(in);
+        return nullptr;
+    }
+    fclose(in);
+    *size = used;
+    return data;
+}
+
 lex_file* lex_open(const char *file)
 {
     lex_file  *lex;
-    FILE *in = fopen(file, "rb");
-    uint32_t   read;
+    void      *data;
+    size_t     size   = 0;
+    bool       mapped = true;
 
-    if (!in) {
+    if (!(data = util_mapfile(file, &size))) {
+        mapped = false;
+        data   = lex_readfile(file, &size);
+    }
+
+    if (!data) {
         lexerror(nullptr, "open failed: '%s'\n", file);
         return nullptr;
     }
 
     lex = (lex_file*)mem_a(sizeof(*lex));
     if (!lex) {
-        fclose(in);
+        if (mapped)
+            util_unmapfile(data, size);
+        else
+            mem_d(data);
         lexerror(nullptr, "out of memory\n");
         return nullptr;
     }
 
     memset(lex, 0, sizeof(*lex));
 
-    lex->file    = in;
+    lex->open_file          = data;
+    lex->open_file_mapped   = mapped;
+    lex->open_string        = (const char*)data;
+    lex->open_string_length = size;
+    lex->open_string_pos    = 0;
+
     lex->name    = util_strdup(file);
     lex->line    = 1; /* we start counting at 1 */
     lex->column  = 0;
     lex->peekpos = 0;
     lex->eof     = false;
 
-    /* handle BOM */
-    if ((read = (lex_getch(lex) << 16) | (lex_getch(lex) << 8) | lex_getch(lex)) != 0xEFBBBF) {
-        lex_ungetch(lex, (read & 0x0000FF));
-        lex_ungetch(lex, (read & 0x00FF00) >> 8);
-        lex_ungetch(lex, (read & 0xFF0000) >> 16);
-    } else {
-        /*
-         * otherwise the lexer has advanced 3 bytes for the BOM, we need
-         * to set the column back to 0
-         */
-        lex->column = 0;
-    }
+    /* skip the BOM */
+    if (size >= 3 && !memcmp(data, "\xEF\xBB\xBF", 3))
+        lex->open_string_pos = 3;
 
     vec_push(lex_filenames, lex->name);
     return lex;
@@ -130,7 +281,6 @@ lex_file* lex_open_string(const char *str, size_t len, const char *name)
 
     memset(lex, 0, sizeof(*lex));
 
-    lex->file = nullptr;
     lex->open_string        = str;
     lex->open_string_length = len;
     lex->open_string_pos    = 0;
@@ -146,6 +296,22 @@ lex_file* lex_open_string(const char *str, size_t len, const char *name)
     return lex;
 }
 
+lex_file* lex_open_segments(const lex_segment *segments, size_t count, const char *name)
+{
+    lex_file *lex;
+
+    if (!count)
+        return lex_open_string("", 0, name);
+
+    lex = lex_open_string(segments[0].data, segments[0].length, name);
+    if (!lex)
+        return nullptr;
+
+    lex->open_segments      = segments + 1;
+    lex->open_segments_left = count - 1;
+    return lex;
+}
+
 void lex_cleanup(void)
 {
     size_t i;
@@ -164,8 +330,10 @@ void lex_close(lex_file *lex)
     if (lex->modelname)
         vec_free(lex->modelname);
 
-    if (lex->file)
-        fclose(lex->file);
+    if (lex->open_file && lex->open_file_mapped)
+        util_unmapfile(lex->open_file, lex->open_string_length);
+    else if (lex->open_file)
+        mem_d(lex->open_file);
 
     vec_free(lex->tok.value);
 
@@ -175,19 +343,54 @@ void lex_close(lex_file *lex)
 
 
 
+/* Move on to the next segment of a lex_open_segments source */
+static bool lex_nextsegment(lex_file *lex)
+{
+    do {
+        if (!lex->open_segments_left)
+            return false;
+        lex->open_string        = lex->open_segments->data;
+        lex->open_string_length = lex->open_segments->length;
+        lex->open_string_pos    = 0;
+        lex->open_segments++;
+        lex->open_segments_left--;
+    } while (!lex->open_string_length);
+    return true;
+}
+
 static int lex_fgetc(lex_file *lex)
 {
-    if (lex->file) {
-        lex->column++;
-        return fgetc(lex->file);
-    }
-    if (lex->open_string) {
-        if (lex->open_string_pos >= lex->open_string_length)
-            return EOF;
-        lex->column++;
-        return lex->open_string[lex->open_string_pos++];
-    }
-    return EOF;
+    if (lex->open_string_pos >= lex->open_string_length && !lex_nextsegment(lex))
+        return EOF;
+    lex->column++;
+    return (unsigned char)lex->open_string[lex->open_string_pos++];
+}
+
+/* The loops scanning identifiers, whitespace and comments take runs of
+ * characters straight from the buffer rather than one lex_getch() at a
+ * time. This is only done while nothing has been put back, and `accept'
+ * must reject anything lex_getch() treats specially: line breaks and the
+ * characters which may start a trigraph or digraph. A run never crosses
+ * the end of a segment.
+ * Returns the start of the run, whose length is stored in `len'.
+ */
+static inline const char *lex_takerun(lex_file *lex, bool (*accept)(int), size_t *len)
+{
+    const char *from = lex->open_string + lex->open_string_pos;
+    const char *end  = lex->open_string + lex->open_string_length;
+    const char *at   = from;
+
+    *len = 0;
+    if (lex->peekpos)
+        return from;
+
+    while (at != end && accept((unsigned char)*at))
+        at++;
+
+    *len = at - from;
+    lex->open_string_pos += *len;
+    lex->column          += *len;
+    return from;
 }
 
 /* Get or put-back data
@@ -313,12 +516,30 @@ static bool isxdigit_only(int ch)
     return (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
 }
 
+/* runs of characters for lex_takerun */
+static bool isblank_run(int ch)
+{
+    return ch == ' ' || ch == '\t';
+}
+
+static bool iscomment_run(int ch)
+{
+    return ch != '\n' && ch != '*' && ch != '?' && ch != '<' && ch != ':' && ch != '%';
+}
+
 /* Append a character to the token buffer */
 static void lex_tokench(lex_file *lex, int ch)
 {
     vec_push(lex->tok.value, ch);
 }
 
+/* Append `len' spaces to the token buffer, standing in for a comment */
+static void lex_tokenspaces(lex_file *lex, size_t len)
+{
+    if (len)
+        memset(vec_add(lex->tok.value, len), ' ', len);
+}
+
 /* Append a trailing null-byte */
 static void lex_endtoken(lex_file *lex)
 {
@@ -478,6 +699,8 @@ static int lex_skipwhite(lex_file *lex, bool hadwhite)
 {
     int ch = 0;
     bool haswhite = hadwhite;
+    const char *run;
+    size_t len;
 
     do
     {
@@ -502,6 +725,9 @@ static int lex_skipwhite(lex_file *lex, bool hadwhite)
                 haswhite = true;
                 lex_tokench(lex, ch);
             }
+            run = lex_takerun(lex, isblank_run, &len);
+            if (lex->flags.preprocessing && len)
+                vec_append(lex->tok.value, len, run);
             ch = lex_getch(lex);
         }
 
@@ -521,6 +747,9 @@ static int lex_skipwhite(lex_file *lex, bool hadwhite)
                 while (ch != EOF && ch != '\n') {
                     if (lex->flags.preprocessing)
                         lex_tokench(lex, ' '); /* ch); */
+                    lex_takerun(lex, iscomment_run, &len);
+                    if (lex->flags.preprocessing)
+                        lex_tokenspaces(lex, len);
                     ch = lex_getch(lex);
                 }
                 if (lex->flags.preprocessing) {
@@ -541,6 +770,9 @@ static int lex_skipwhite(lex_file *lex, bool hadwhite)
 
                 while (ch != EOF)
                 {
+                    lex_takerun(lex, iscomment_run, &len);
+                    if (lex->flags.preprocessing)
+                        lex_tokenspaces(lex, len);
                     ch = lex_getch(lex);
                     if (ch == '*') {
                         ch = lex_getch(lex);
@@ -582,6 +814,12 @@ static int lex_skipwhite(lex_file *lex, bool hadwhite)
 static bool GMQCC_WARN lex_finish_ident(lex_file *lex)
 {
     int ch;
+    const char *run;
+    size_t len;
+
+    run = lex_takerun(lex, isident, &len);
+    if (len)
+        vec_append(lex->tok.value, len, run);
 
     ch = lex_getch(lex);
     while (ch != EOF && isident(ch))
@@ -1288,7 +1526,7 @@ int lex_do(lex_file *lex)
 
     if (isident_start(ch))
     {
-        const char *v;
+        const lex_word *word;
 
         lex_tokench(lex, ch);
         if (!lex_finish_ident(lex)) {
@@ -1298,44 +1536,17 @@ int lex_do(lex_file *lex)
         lex_endtoken(lex);
         lex->tok.ttype = TOKEN_IDENT;
 
-        v = lex->tok.value;
-        if (!strcmp(v, "void")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_VOID;
-        } else if (!strcmp(v, "int")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_INTEGER;
-        } else if (!strcmp(v, "float")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_FLOAT;
-        } else if (!strcmp(v, "bool")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_BOOL;
-        } else if (!strcmp(v, "string")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_STRING;
-        } else if (!strcmp(v, "entity")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_ENTITY;
-        } else if (!strcmp(v, "vector")) {
-            lex->tok.ttype = TOKEN_TYPENAME;
-            lex->tok.constval.t = TYPE_VECTOR;
-        } else if (!strcmp(v, "_length")) {
-            lex->tok.ttype = TOKEN_OPERATOR;
-        } else {
-            size_t kw;
-            for (kw = 0; kw < GMQCC_ARRAY_COUNT(keywords_qc); ++kw) {
-                if (!strcmp(v, keywords_qc[kw]))
-                    return (lex->tok.ttype = TOKEN_KEYWORD);
-            }
-            if (OPTS_OPTION_U32(OPTION_STANDARD) != COMPILER_QCC) {
-                for (kw = 0; kw < GMQCC_ARRAY_COUNT(keywords_fg); ++kw) {
-                    if (!strcmp(v, keywords_fg[kw]))
-                        return (lex->tok.ttype = TOKEN_KEYWORD);
-                }
-            }
+        word = lex_findword(lex->tok.value, vec_size(lex->tok.value));
+        if (word && !(word->fg && OPTS_OPTION_U32(OPTION_STANDARD) == COMPILER_QCC)) {
+            lex->tok.ttype = word->ttype;
+            if (word->ttype == TOKEN_TYPENAME)
+                lex->tok.constval.t = word->type;
         }
 
+        /* the parser looks identifiers up by their interned name */
+        if (lex->tok.ttype == TOKEN_IDENT && !lex->flags.preprocessing)
+            lex->tok.name = util_intern(lex->tok.value);
+
         return lex->tok.ttype;
     }
 
@@ -5,6 +5,7 @@
 struct token {
     int ttype;
     char *value;
+    const char *name; /* util_intern'd value of an identifier, unless preprocessing */
     union {
         vec3_t v;
         int i;
@@ -67,10 +68,19 @@ struct frame_macro {
 };
 
 struct lex_file {
-    FILE  *file;
+    /* the whole source is read through this buffer: either the string
+     * passed to lex_open_string, one of the segments passed to
+     * lex_open_segments or the contents of the file, which are owned by
+     * the lexer (open_file) and released by lex_close
+     */
     const char *open_string;
     size_t      open_string_length;
     size_t      open_string_pos;
+    void       *open_file;
+    bool        open_file_mapped;
+    /* the segments following the one in open_string */
+    const lex_segment *open_segments;
+    size_t             open_segments_left;
 
     char   *name;
     size_t  line;
@@ -100,6 +110,7 @@ struct lex_file {
 
 lex_file* lex_open (const char *file);
 lex_file* lex_open_string(const char *str, size_t len, const char *name);
+lex_file* lex_open_segments(const lex_segment *segments, size_t count, const char *name);
 void      lex_close(lex_file   *lex);
 int       lex_do   (lex_file   *lex);
 void      lex_cleanup(void);
@@ -678,26 +678,29 @@ int main(int argc, char **argv) {
             }
 
             if (OPTS_OPTION_BOOL(OPTION_PP_ONLY)) {
-                const char *out;
+                const lex_segment *out;
+                size_t             count;
+                size_t             i;
                 if (!ftepp_preprocess_file(ftepp, items[itr].filename)) {
                     retval = 1;
                     goto cleanup;
                 }
-                out = ftepp_get(ftepp);
-                if (out)
-                    fprintf(outfile, "%s", out);
+                out = ftepp_get(ftepp, &count);
+                for (i = 0; i < count; ++i)
+                    fwrite(out[i].data, 1, out[i].length, outfile);
                 ftepp_flush(ftepp);
             }
             else {
                 if (OPTS_FLAG(FTEPP)) {
-                    const char *data;
+                    const lex_segment *data;
+                    size_t             count;
                     if (!ftepp_preprocess_file(ftepp, items[itr].filename)) {
                         retval = 1;
                         goto cleanup;
                     }
-                    data = ftepp_get(ftepp);
-                    if (vec_size(data)) {
-                        if (!parser_compile_string(parser, items[itr].filename, data, vec_size(data))) {
+                    data = ftepp_get(ftepp, &count);
+                    if (count) {
+                        if (!parser_compile_segments(parser, items[itr].filename, data, count)) {
                             retval = 1;
                             goto cleanup;
                         }
@@ -747,6 +750,7 @@ cleanup:
         mem_d((void*)operators);
 
     lex_cleanup();
+    util_interncleanup();
 
     if (!retval && compile_errors)
         retval = 1;
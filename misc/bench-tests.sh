@@ -0,0 +1,52 @@
+#!/bin/sh
+# Runs qcvm -bench over the executing tests of the testsuite and prints the
+# reports as one JSON array.  Extra arguments are passed on to qcvm, so two
+# runs can be compared, e.g.:
+#     misc/bench-tests.sh > switch.json
+#     misc/bench-tests.sh -threaded > threaded.json
+# GMQCC, GMQCCFLAGS, QCVM and RUNS can be set in the environment.
+prog=$0
+
+GMQCC=${GMQCC:-./gmqcc}
+QCVM=${QCVM:-./qcvm}
+RUNS=${RUNS:-100}
+
+for i in "$GMQCC" "$QCVM" tests/defs.qh; do
+	test -e "$i" && continue
+	echo "$prog: missing $i" >&2
+	echo "$prog: run this script from the top of a gmqcc source tree" >&2
+	exit 1
+done
+
+# prints the value of a tag of a test template
+tag() {
+	sed -ne "s/^$2:[[:space:]]*//p" "$1" | head -n 1
+}
+
+dat=$(mktemp)
+trap 'rm -f "$dat"' EXIT
+
+sep='['
+for tmpl in tests/*.tmpl; do
+	test "$(tag "$tmpl" T)" = "-execute" || continue
+
+	defs=tests/defs.qh
+	test "$(tag "$tmpl" F)" = "-no-defs" && defs=
+	eflags=$(tag "$tmpl" E)
+	test "$eflags" = '$null' && eflags=
+
+	# the flags are split into words on purpose
+	if ! "$GMQCC" $defs "tests/$(tag "$tmpl" I)" $(tag "$tmpl" C) $GMQCCFLAGS -o "$dat" >/dev/null 2>&1; then
+		echo "$prog: $tmpl: failed to compile" >&2
+		continue
+	fi
+	if ! out=$("$QCVM" "$@" -bench "$RUNS" $eflags "$dat" 2>/dev/null); then
+		echo "$prog: $tmpl: failed to run" >&2
+		continue
+	fi
+
+	printf '%s\n{ "test": "%s", "bench": %s }' "$sep" "$(basename "$tmpl" .tmpl)" "$out"
+	sep=','
+done
+[ "$sep" = '[' ] && printf '['
+printf '\n]\n'
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Checks that qcvm -bench rejects bad arguments and that its JSON report
+# has every key misc/bench-tests.sh and its readers rely on.
+# GMQCC and QCVM can be set in the environment.
+prog=$0
+
+GMQCC=${GMQCC:-./gmqcc}
+QCVM=${QCVM:-./qcvm}
+
+for i in "$GMQCC" "$QCVM" tests/batch.jobs; do
+	test -e "$i" && continue
+	echo "$prog: missing $i"
+	echo "$prog: run this script from the top of a gmqcc source tree"
+	exit 1
+done
+
+src=$(mktemp)
+dat=$(mktemp)
+trap 'rm -f "$src" "$dat"' EXIT
+
+# no builtins, so it runs however the compiler numbers them
+cat > "$src" <<EOF
+float fib(float n) {
+    if (n < 2.0)
+        return n;
+    return fib(n - 1.0) + fib(n - 2.0);
+}
+
+void main(float n) {
+    fib(n);
+}
+EOF
+
+if ! "$GMQCC" "$src" -std=gmqcc -o "$dat" >/dev/null 2>&1; then
+	echo "$prog: failed to compile the benchmark"
+	exit 1
+fi
+
+failed=0
+
+# the arguments have to be rejected with the given message on stderr
+reject() {
+	message=$1
+	shift
+	if err=$("$QCVM" "$@" "$dat" 2>&1 >/dev/null); then
+		echo "$prog: accepted: $*"
+		failed=1
+	elif ! printf '%s\n' "$err" | grep -qF -- "$message"; then
+		echo "$prog: $*: expected \`$message', got: $err"
+		failed=1
+	fi
+}
+
+reject ''                      -bench 0
+reject ''                      -bench 2x
+reject ''                      -bench 2 -warmup x
+reject '-batch cannot be combined with -bench'  -bench 2 -batch tests/batch.jobs
+reject '-record and -replay cannot be combined' -bench 2 -record /dev/null
+reject '-record and -replay cannot be combined' -bench 2 -replay /dev/null
+
+if ! out=$("$QCVM" -bench 2 -warmup 0 -float 10 "$dat" 2>&1); then
+	echo "$prog: -bench failed: $out"
+	exit 1
+fi
+
+for key in program function flags entcolumns warmup runs seconds     \
+           fastest_run_seconds statements_per_run calls_per_run       \
+           statements_per_second calls_per_second                     \
+           nanoseconds_per_statement opcodes allocations              \
+           entities_spawned entities_reused entities_freed            \
+           entity_growths entity_capacity tempstrings                 \
+           tempstring_bytes tempstring_wraps
+do
+	printf '%s\n' "$out" | grep -q "^ *\"$key\": " || {
+		echo "$prog: missing key: $key"
+		failed=1
+	}
+done
+
+# fib(10) makes 177 calls, main is one more
+for value in '"function": "main"' '"warmup": 0' '"runs": 2' \
+             '"flags": \[\]' '"calls_per_run": 178'
+do
+	printf '%s\n' "$out" | grep -q "$value" || {
+		echo "$prog: missing: $value"
+		failed=1
+	}
+done
+
+exit $failed
@@ -76,6 +76,8 @@ static bool parser_next(parser_t *parser)
 
 #define parser_tokval(p) ((p)->lex->tok.value)
 #define parser_token(p)  (&((p)->lex->tok))
+/* the interned token value, which identifiers already come with */
+#define parser_tokname(p) ((p)->lex->tok.name ? (p)->lex->tok.name : util_intern(parser_tokval(p)))
 
 char *parser_strdup(const char *str)
 {
@@ -88,11 +90,16 @@ char *parser_strdup(const char *str)
     return util_strdup(str);
 }
 
+/*
+ * The symbol tables are keyed by interned names: the lookups taking a
+ * `const char *` expect a util_intern (or parser_tokname) string, the
+ * std::string ones intern it themselves.
+ */
 static ast_expression* parser_find_field(parser_t *parser, const char *name) {
     return (ast_expression*)util_htget(parser->htfields, name);
 }
 static ast_expression* parser_find_field(parser_t *parser, const std::string &name) {
-    return parser_find_field(parser, name.c_str());
+    return parser_find_field(parser, util_intern(name.c_str()));
 }
 
 static ast_expression* parser_find_label(parser_t *parser, const char *name)
@@ -108,14 +115,14 @@ static inline ast_expression* parser_find_label(parser_t *parser, const std::str
 
 ast_expression* parser_find_global(parser_t *parser, const char *name)
 {
-    ast_expression *var = (ast_expression*)util_htget(parser->aliases, parser_tokval(parser));
+    ast_expression *var = (ast_expression*)util_htget(parser->aliases, parser_tokname(parser));
     if (var)
         return var;
     return (ast_expression*)util_htget(parser->htglobals, name);
 }
 
 ast_expression* parser_find_global(parser_t *parser, const std::string &name) {
-    return parser_find_global(parser, name.c_str());
+    return parser_find_global(parser, util_intern(name.c_str()));
 }
 
 static ast_expression* parser_find_param(parser_t *parser, const char *name)
@@ -149,7 +156,7 @@ static ast_expression* parser_find_local(parser_t *parser, const char *name, siz
 }
 
 static ast_expression* parser_find_local(parser_t *parser, const std::string &name, size_t upto, bool *isparam) {
-    return parser_find_local(parser, name.c_str(), upto, isparam);
+    return parser_find_local(parser, util_intern(name.c_str()), upto, isparam);
 }
 
 static ast_expression* parser_find_var(parser_t *parser, const char *name)
@@ -162,7 +169,7 @@ static ast_expression* parser_find_var(parser_t *parser, const char *name)
 }
 
 static inline ast_expression* parser_find_var(parser_t *parser, const std::string &name) {
-    return parser_find_var(parser, name.c_str());
+    return parser_find_var(parser, util_intern(name.c_str()));
 }
 
 static ast_value* parser_find_typedef(parser_t *parser, const char *name, size_t upto)
@@ -180,7 +187,7 @@ static ast_value* parser_find_typedef(parser_t *parser, const char *name, size_t
 }
 
 static ast_value* parser_find_typedef(parser_t *parser, const std::string &name, size_t upto) {
-    return parser_find_typedef(parser, name.c_str(), upto);
+    return parser_find_typedef(parser, util_intern(name.c_str()), upto);
 }
 
 struct sy_elem {
@@ -1610,9 +1617,9 @@ static bool parse_sya_operand(parser_t *parser, shunt *sy, bool with_labels)
         {
             var = parser->const_vec[ctoken[0]-'x'];
         } else {
-            var = parser_find_var(parser, parser_tokval(parser));
+            var = parser_find_var(parser, parser_tokname(parser));
             if (!var)
-                var = parser_find_field(parser, parser_tokval(parser));
+                var = parser_find_field(parser, parser_tokname(parser));
         }
         if (!var && with_labels) {
             var = parser_find_label(parser, parser_tokval(parser));
@@ -1993,9 +2000,9 @@ static ast_expression* parse_expression(parser_t *parser, bool stopatcomma, bool
 
 static void parser_enterblock(parser_t *parser)
 {
-    vec_push(parser->variables, util_htnew(PARSER_HT_SIZE));
+    vec_push(parser->variables, util_htnewinterned(PARSER_HT_SIZE));
     vec_push(parser->_blocklocals, vec_size(parser->_locals));
-    vec_push(parser->typedefs, util_htnew(TYPEDEF_HT_SIZE));
+    vec_push(parser->typedefs, util_htnewinterned(TYPEDEF_HT_SIZE));
     vec_push(parser->_blocktypedefs, vec_size(parser->_typedefs));
     vec_push(parser->_block_ctx, parser_ctx(parser));
 }
@@ -2049,7 +2056,7 @@ static void parser_addlocal(parser_t *parser, const char *name, ast_expression *
     util_htset(vec_last(parser->variables), name, (void*)e);
 }
 static void parser_addlocal(parser_t *parser, const std::string &name, ast_expression *e) {
-    return parser_addlocal(parser, name.c_str(), e);
+    return parser_addlocal(parser, util_intern(name.c_str()), e);
 }
 
 static void parser_addglobal(parser_t *parser, const char *name, ast_expression *e)
@@ -2058,7 +2065,7 @@ static void parser_addglobal(parser_t *parser, const char *name, ast_expression
     util_htset(parser->htglobals, name, e);
 }
 static void parser_addglobal(parser_t *parser, const std::string &name, ast_expression *e) {
-    return parser_addglobal(parser, name.c_str(), e);
+    return parser_addglobal(parser, util_intern(name.c_str()), e);
 }
 
 static ast_expression* process_condition(parser_t *parser, ast_expression *cond, bool *_ifnot)
@@ -2067,7 +2074,7 @@ static ast_expression* process_condition(parser_t *parser, ast_expression *cond,
     ast_unary *unary;
     ast_expression *prev;
 
-    if (cond->m_vtype == TYPE_VOID || cond->m_vtype >= TYPE_VARIANT) {
+    if (cond->m_vtype == TYPE_VOID || (cond->m_vtype >= TYPE_VARIANT && cond->m_vtype != TYPE_BOOL)) {
         char ty[1024];
         ast_type_to_string(cond, ty, sizeof(ty));
         compile_error(cond->m_context, "invalid type for if() condition: %s", ty);
@@ -2503,7 +2510,7 @@ static bool parse_for_go(parser_t *parser, ast_block *block, ast_expression **ou
 
     typevar = nullptr;
     if (parser->tok == TOKEN_IDENT)
-        typevar = parser_find_typedef(parser, parser_tokval(parser), 0);
+        typevar = parser_find_typedef(parser, parser_tokname(parser), 0);
 
     if (typevar || parser->tok == TOKEN_TYPENAME) {
         if (!parse_variable(parser, block, true, CV_VAR, typevar, false, false, 0, nullptr))
@@ -3086,7 +3093,7 @@ static bool parse_switch_go(parser_t *parser, ast_block *block, ast_expression *
     while (true) {
         typevar = nullptr;
         if (parser->tok == TOKEN_IDENT)
-            typevar = parser_find_typedef(parser, parser_tokval(parser), 0);
+            typevar = parser_find_typedef(parser, parser_tokname(parser), 0);
         if (typevar || parser->tok == TOKEN_TYPENAME) {
             if (!parse_variable(parser, block, true, CV_NONE, typevar, false, false, 0, nullptr)) {
                 delete switchnode;
@@ -3387,7 +3394,7 @@ static bool parse_statement(parser_t *parser, ast_block *block, ast_expression *
     *out = nullptr;
 
     if (parser->tok == TOKEN_IDENT)
-        typevar = parser_find_typedef(parser, parser_tokval(parser), 0);
+        typevar = parser_find_typedef(parser, parser_tokname(parser), 0);
 
     if (typevar || parser->tok == TOKEN_TYPENAME || parser->tok == '.' || parser->tok == TOKEN_DOTS)
     {
@@ -3422,7 +3429,7 @@ static bool parse_statement(parser_t *parser, ast_block *block, ast_expression *
                 return false;
             }
 
-            if (parser->tok == TOKEN_IDENT && (tdef = parser_find_typedef(parser, parser_tokval(parser), 0)))
+            if (parser->tok == TOKEN_IDENT && (tdef = parser_find_typedef(parser, parser_tokname(parser), 0)))
             {
                 ast_type_to_string(tdef, ty, sizeof(ty));
                 con_out("__builtin_debug_printtype: `%s`=`%s`\n", tdef->m_name.c_str(), ty);
@@ -3627,9 +3634,9 @@ static bool parse_enum(parser_t *parser)
             goto onerror;
         }
 
-        old = parser_find_field(parser, parser_tokval(parser));
+        old = parser_find_field(parser, parser_tokname(parser));
         if (!old)
-            old = parser_find_global(parser, parser_tokval(parser));
+            old = parser_find_global(parser, parser_tokname(parser));
         if (old) {
             parseerror(parser, "value `%s` has already been declared here: %s:%i",
                        parser_tokval(parser), old->m_context.file, old->m_context.line);
@@ -3845,16 +3852,16 @@ static bool parse_function_body(parser_t *parser, ast_value *var)
          */
         nextthink = nullptr;
 
-        fld_think     = parser_find_field(parser, "think");
-        fld_nextthink = parser_find_field(parser, "nextthink");
-        fld_frame     = parser_find_field(parser, "frame");
+        fld_think     = parser_find_field(parser, util_intern("think"));
+        fld_nextthink = parser_find_field(parser, util_intern("nextthink"));
+        fld_frame     = parser_find_field(parser, util_intern("frame"));
         if (!fld_think || !fld_nextthink || !fld_frame) {
             parseerror(parser, "cannot use [frame,think] notation without the required fields");
             parseerror(parser, "please declare the following entityfields: `frame`, `think`, `nextthink`");
             return false;
         }
-        gbl_time      = parser_find_global(parser, "time");
-        gbl_self      = parser_find_global(parser, "self");
+        gbl_time      = parser_find_global(parser, util_intern("time"));
+        gbl_self      = parser_find_global(parser, util_intern("self"));
         if (!gbl_time || !gbl_self) {
             parseerror(parser, "cannot use [frame,think] notation without the required globals");
             parseerror(parser, "please declare the following globals: `time`, `self`");
@@ -3887,7 +3894,7 @@ static bool parse_function_body(parser_t *parser, ast_value *var)
             return false;
         }
 
-        if (parser->tok == TOKEN_IDENT && !parser_find_var(parser, parser_tokval(parser)))
+        if (parser->tok == TOKEN_IDENT && !parser_find_var(parser, parser_tokname(parser)))
         {
             /* qc allows the use of not-yet-declared functions here
              * - this automatically creates a prototype */
@@ -4805,7 +4812,7 @@ static ast_value *parse_typename(parser_t *parser, ast_value **storebase, ast_va
         }
     }
     if (parser->tok == TOKEN_IDENT)
-        cached_typedef = parser_find_typedef(parser, parser_tokval(parser), 0);
+        cached_typedef = parser_find_typedef(parser, parser_tokname(parser), 0);
     if (!cached_typedef && parser->tok != TOKEN_TYPENAME) {
         if (vararg && is_vararg) {
             *is_vararg = true;
@@ -4954,7 +4961,7 @@ static bool parse_typedef(parser_t *parser)
     }
 
     vec_push(parser->_typedefs, typevar);
-    util_htset(vec_last(parser->typedefs), typevar->m_name.c_str(), typevar);
+    util_htset(vec_last(parser->typedefs), util_intern(typevar->m_name.c_str()), typevar);
 
     if (parser->tok != ';') {
         parseerror(parser, "expected semicolon after typedef");
@@ -5377,11 +5384,11 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                 if (!nofields && var->m_vtype == TYPE_FIELD && parser->tok != '=') {
                     var->m_isfield = true;
                     parser->fields.push_back(var);
-                    util_htset(parser->htfields, var->m_name.c_str(), var);
+                    util_htset(parser->htfields, util_intern(var->m_name.c_str()), var);
                     if (isvector) {
                         for (i = 0; i < 3; ++i) {
                             parser->fields.push_back(me[i]);
-                            util_htset(parser->htfields, me[i]->m_name.c_str(), me[i]);
+                            util_htset(parser->htfields, util_intern(me[i]->m_name.c_str()), me[i]);
                         }
                     }
                 }
@@ -5390,7 +5397,7 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                         parser_addglobal(parser, var->m_name, var);
                         if (isvector) {
                             for (i = 0; i < 3; ++i) {
-                                parser_addglobal(parser, me[i]->m_name.c_str(), me[i]);
+                                parser_addglobal(parser, me[i]->m_name, me[i]);
                             }
                         }
                     } else {
@@ -5414,7 +5421,7 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                             return false;
                         }
 
-                        util_htset(parser->aliases, var->m_name.c_str(), find);
+                        util_htset(parser->aliases, util_intern(var->m_name.c_str()), find);
 
                         /* generate aliases for vector components */
                         if (isvector) {
@@ -5424,9 +5431,9 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                             util_asprintf(&buffer[1], "%s_y", var->m_desc.c_str());
                             util_asprintf(&buffer[2], "%s_z", var->m_desc.c_str());
 
-                            util_htset(parser->aliases, me[0]->m_name.c_str(), parser_find_global(parser, buffer[0]));
-                            util_htset(parser->aliases, me[1]->m_name.c_str(), parser_find_global(parser, buffer[1]));
-                            util_htset(parser->aliases, me[2]->m_name.c_str(), parser_find_global(parser, buffer[2]));
+                            util_htset(parser->aliases, util_intern(me[0]->m_name.c_str()), parser_find_global(parser, util_intern(buffer[0])));
+                            util_htset(parser->aliases, util_intern(me[1]->m_name.c_str()), parser_find_global(parser, util_intern(buffer[1])));
+                            util_htset(parser->aliases, util_intern(me[2]->m_name.c_str()), parser_find_global(parser, util_intern(buffer[2])));
 
                             mem_d(buffer[0]);
                             mem_d(buffer[1]);
@@ -5449,7 +5456,7 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                     prefix_len = defname.length();
 
                     // Add it to the local scope
-                    util_htset(vec_last(parser->variables), var->m_name.c_str(), (void*)var);
+                    util_htset(vec_last(parser->variables), util_intern(var->m_name.c_str()), (void*)var);
 
                     // now rename the global
                     defname.append(var->m_name);
@@ -5479,7 +5486,7 @@ static bool parse_variable(parser_t *parser, ast_block *localblock, bool nofield
                     if (isvector) {
                         defname.erase(prefix_len);
                         for (i = 0; i < 3; ++i) {
-                            util_htset(vec_last(parser->variables), me[i]->m_name.c_str(), (void*)(me[i]));
+                            util_htset(vec_last(parser->variables), util_intern(me[i]->m_name.c_str()), (void*)(me[i]));
                             me[i]->m_name = move(defname + me[i]->m_name);
                             parser->globals.push_back(me[i]);
                         }
@@ -5854,7 +5861,7 @@ static bool parser_global_statement(parser_t *parser)
     char      *vstring   = nullptr;
 
     if (parser->tok == TOKEN_IDENT)
-        istype = parser_find_typedef(parser, parser_tokval(parser), 0);
+        istype = parser_find_typedef(parser, parser_tokname(parser), 0);
 
     if (istype || parser->tok == TOKEN_TYPENAME || parser->tok == '.' || parser->tok == TOKEN_DOTS)
     {
@@ -6003,12 +6010,12 @@ parser_t *parser_create()
         return nullptr;
     }
 
-    vec_push(parser->variables, parser->htfields  = util_htnew(PARSER_HT_SIZE));
-    vec_push(parser->variables, parser->htglobals = util_htnew(PARSER_HT_SIZE));
-    vec_push(parser->typedefs, util_htnew(TYPEDEF_HT_SIZE));
+    vec_push(parser->variables, parser->htfields  = util_htnewinterned(PARSER_HT_SIZE));
+    vec_push(parser->variables, parser->htglobals = util_htnewinterned(PARSER_HT_SIZE));
+    vec_push(parser->typedefs, util_htnewinterned(TYPEDEF_HT_SIZE));
     vec_push(parser->_blocktypedefs, 0);
 
-    parser->aliases = util_htnew(PARSER_HT_SIZE);
+    parser->aliases = util_htnewinterned(PARSER_HT_SIZE);
 
     empty_ctx.file   = "<internal>";
     empty_ctx.line   = 0;
@@ -6016,19 +6023,19 @@ parser_t *parser_create()
     parser->nil = new ast_value(empty_ctx, "nil", TYPE_NIL);
     parser->nil->m_cvq = CV_CONST;
     if (OPTS_FLAG(UNTYPED_NIL))
-        util_htset(parser->htglobals, "nil", (void*)parser->nil);
+        util_htset(parser->htglobals, util_intern("nil"), (void*)parser->nil);
 
     parser->const_true = new ast_value(empty_ctx, "true", TYPE_BOOL);
     parser->const_true->m_cvq = CV_CONST;
     parser->const_true->m_hasvalue = true;
     parser->const_true->m_constval.vfloat = 1;
-    util_htset(parser->htglobals, "true", (void *) parser->const_true);
+    util_htset(parser->htglobals, util_intern("true"), (void *) parser->const_true);
 
     parser->const_false = new ast_value(empty_ctx, "false", TYPE_BOOL);
     parser->const_false->m_cvq = CV_CONST;
     parser->const_false->m_hasvalue = true;
     parser->const_false->m_constval.vfloat = 0;
-    util_htset(parser->htglobals, "false", (void *) parser->const_false);
+    util_htset(parser->htglobals, util_intern("false"), (void *) parser->const_false);
 
     parser->max_param_count = 1;
 
@@ -6103,6 +6110,16 @@ bool parser_compile_string(parser_t *parser, const char *name, const char *str,
     return parser_compile(parser);
 }
 
+bool parser_compile_segments(parser_t *parser, const char *name, const lex_segment *segments, size_t count)
+{
+    parser->lex = lex_open_segments(segments, count, name);
+    if (!parser->lex) {
+        con_err("failed to create lexer for string \"%s\"\n", name);
+        return false;
+    }
+    return parser_compile(parser);
+}
+
 static void parser_remove_ast(parser_t *parser)
 {
     size_t i;
@@ -78,6 +78,6 @@ struct parser_t {
 
 /* parser.c */
 char           *parser_strdup     (const char *str);
-ast_expression *parser_find_global(parser_t *parser, const char *name);
+ast_expression *parser_find_global(parser_t *parser, const char *name); /* name is util_intern'd */
 
 #endif
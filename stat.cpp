@@ -64,15 +64,32 @@ struct hash_node_t {
 size_t hash(const char *key);
 
 size_t util_hthash(hash_table_t *ht, const char *key) {
+    if (ht->interned)
+        return util_internhash(key) % ht->size;
     return hash(key) % ht->size;
 }
 
-static hash_node_t *_util_htnewpair(const char *key, void *value) {
+/*
+ * Keys of a table made with util_htnewinterned are interned strings, so
+ * they are compared (and ordered in the chains) by address, and the
+ * table does not own a copy of them.
+ */
+static int _util_htkeycmp(hash_table_t *ht, const char *key, const char *other) {
+    /* interned keys are ordered by address, compared as integers since
+     * relational operators on unrelated pointers are unspecified */
+    if (ht->interned)
+        return ((uintptr_t)key > (uintptr_t)other) - ((uintptr_t)key < (uintptr_t)other);
+    return strcmp(key, other);
+}
+
+static hash_node_t *_util_htnewpair(hash_table_t *ht, const char *key, void *value) {
     hash_node_t *node;
     if (!(node = (hash_node_t*)mem_a(sizeof(hash_node_t))))
         return nullptr;
 
-    if (!(node->key = util_strdupe(key))) {
+    if (ht->interned)
+        node->key = (char*)key;
+    else if (!(node->key = util_strdupe(key))) {
         mem_d(node);
         return nullptr;
     }
@@ -86,6 +103,7 @@ static hash_node_t *_util_htnewpair(const char *key, void *value) {
 /*
  * EXPOSED INTERFACE for the hashtable implementation
  * util_htnew(size)                             -- to make a new hashtable
+ * util_htnewinterned(size)                     -- same, keyed by util_intern strings
  * util_htset(table, key, value, sizeof(value)) -- to set something in the table
  * util_htget(table, key)                       -- to get something from the table
  * util_htdel(table)                            -- to delete the table
@@ -104,12 +122,20 @@ hash_table_t *util_htnew(size_t size) {
         return nullptr;
     }
 
-    hashtable->size = size;
+    hashtable->size     = size;
+    hashtable->interned = false;
     memset(hashtable->table, 0, sizeof(hash_node_t*) * size);
 
     return hashtable;
 }
 
+hash_table_t *util_htnewinterned(size_t size) {
+    hash_table_t *hashtable = util_htnew(size);
+    if (hashtable)
+        hashtable->interned = true;
+    return hashtable;
+}
+
 void util_htseth(hash_table_t *ht, const char *key, size_t bin, void *value) {
     hash_node_t *newnode = nullptr;
     hash_node_t *next    = nullptr;
@@ -117,15 +143,15 @@ void util_htseth(hash_table_t *ht, const char *key, size_t bin, void *value) {
 
     next = ht->table[bin];
 
-    while (next && next->key && strcmp(key, next->key) > 0)
+    while (next && next->key && _util_htkeycmp(ht, key, next->key) > 0)
         last = next, next = next->next;
 
     /* already in table, do a replace */
-    if (next && next->key && strcmp(key, next->key) == 0) {
+    if (next && next->key && _util_htkeycmp(ht, key, next->key) == 0) {
         next->value = value;
     } else {
         /* not found, grow a pair man :P */
-        newnode = _util_htnewpair(key, value);
+        newnode = _util_htnewpair(ht, key, value);
         if (next == ht->table[bin]) {
             newnode->next  = next;
             ht->table[bin] = newnode;
@@ -145,10 +171,10 @@ void util_htset(hash_table_t *ht, const char *key, void *value) {
 void *util_htgeth(hash_table_t *ht, const char *key, size_t bin) {
     hash_node_t *pair = ht->table[bin];
 
-    while (pair && pair->key && strcmp(key, pair->key) > 0)
+    while (pair && pair->key && _util_htkeycmp(ht, key, pair->key) > 0)
         pair = pair->next;
 
-    if (!pair || !pair->key || strcmp(key, pair->key) != 0)
+    if (!pair || !pair->key || _util_htkeycmp(ht, key, pair->key) != 0)
         return nullptr;
 
     return pair->value;
@@ -206,7 +232,7 @@ void util_htrem(hash_table_t *ht, void (*callback)(void *data)) {
 
         /* free in list */
         while (n) {
-            if (n->key)
+            if (n->key && !ht->interned)
                 mem_d(n->key);
             if (callback)
                 callback(n->value);
@@ -225,18 +251,19 @@ void util_htrmh(hash_table_t *ht, const char *key, size_t bin, void (*cb)(void*)
     hash_node_t **pair = &ht->table[bin];
     hash_node_t *tmp;
 
-    while (*pair && (*pair)->key && strcmp(key, (*pair)->key) > 0)
+    while (*pair && (*pair)->key && _util_htkeycmp(ht, key, (*pair)->key) > 0)
         pair = &(*pair)->next;
 
     tmp = *pair;
-    if (!tmp || !tmp->key || strcmp(key, tmp->key) != 0)
+    if (!tmp || !tmp->key || _util_htkeycmp(ht, key, tmp->key) != 0)
         return;
 
     if (cb)
         (*cb)(tmp->value);
 
     *pair = tmp->next;
-    mem_d(tmp->key);
+    if (!ht->interned)
+        mem_d(tmp->key);
     mem_d(tmp);
 }
 
@@ -247,3 +274,94 @@ void util_htrm(hash_table_t *ht, const char *key, void (*cb)(void*)) {
 void util_htdel(hash_table_t *ht) {
     util_htrem(ht, nullptr);
 }
+
+/*
+ * String interning: every distinct string is stored once, in chunks, with
+ * its hash in front of it. Interned strings stay valid until
+ * util_interncleanup, so equal strings can be compared by address.
+ */
+#define INTERN_CHUNK 0x10000
+
+static struct {
+    const char **slots;  /* open addressing, power of two */
+    size_t       size;
+    size_t       count;
+    char       **blocks; /* everything allocated, for the cleanup */
+    char        *chunk;  /* the chunk being filled */
+    size_t       chunkused;
+} intern;
+
+static const char *_util_internadd(const char *str, size_t len, size_t hashval) {
+    size_t need = (sizeof(size_t) + len + 1 + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    char  *at;
+
+    if (need > INTERN_CHUNK) {
+        /* oversized strings get a block of their own */
+        at = (char*)mem_a(need);
+        vec_push(intern.blocks, at);
+    } else {
+        if (!intern.chunk || intern.chunkused + need > INTERN_CHUNK) {
+            intern.chunk     = (char*)mem_a(INTERN_CHUNK);
+            intern.chunkused = 0;
+            vec_push(intern.blocks, intern.chunk);
+        }
+        at = intern.chunk + intern.chunkused;
+        intern.chunkused += need;
+    }
+
+    *(size_t*)at = hashval;
+    at += sizeof(size_t);
+    memcpy(at, str, len);
+    at[len] = '\0';
+    return at;
+}
+
+static void _util_interngrow(void) {
+    const char **old  = intern.slots;
+    size_t       size = intern.size;
+    size_t       i, j;
+
+    intern.size  = size ? size * 2 : 1024;
+    intern.slots = (const char**)mem_a(sizeof(*intern.slots) * intern.size);
+    memset(intern.slots, 0, sizeof(*intern.slots) * intern.size);
+
+    for (i = 0; i < size; ++i) {
+        if (!old[i])
+            continue;
+        for (j = util_internhash(old[i]) & (intern.size - 1); intern.slots[j]; j = (j + 1) & (intern.size - 1))
+            ;
+        intern.slots[j] = old[i];
+    }
+    mem_d(old);
+}
+
+const char *util_intern(const char *str) {
+    size_t hashval = hash(str);
+    size_t i;
+
+    if (intern.count * 2 >= intern.size)
+        _util_interngrow();
+
+    for (i = hashval & (intern.size - 1); intern.slots[i]; i = (i + 1) & (intern.size - 1)) {
+        if (util_internhash(intern.slots[i]) == hashval && !strcmp(intern.slots[i], str))
+            return intern.slots[i];
+    }
+
+    intern.count++;
+    return (intern.slots[i] = _util_internadd(str, strlen(str), hashval));
+}
+
+size_t util_internhash(const char *interned) {
+    return ((const size_t*)interned)[-1];
+}
+
+void util_interncleanup(void) {
+    size_t i;
+    for (i = 0; i < vec_size(intern.blocks); ++i)
+        mem_d(intern.blocks[i]);
+    vec_free(intern.blocks);
+    mem_d(intern.slots);
+    memset(&intern, 0, sizeof(intern));
+}
+
+#undef INTERN_CHUNK
@@ -663,15 +663,54 @@ int util_getline(char **lineptr, size_t *n, FILE *stream) {
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 bool util_isatty(FILE *file) {
     if (file == stdout) return !!isatty(STDOUT_FILENO);
     if (file == stderr) return !!isatty(STDERR_FILENO);
     return false;
 }
+
+/* maps a whole file read-only, nullptr when that isn't possible */
+void *util_mapfile(const char *filename, size_t *size) {
+    struct stat st;
+    void       *data;
+    int         fd = open(filename, O_RDONLY);
+
+    if (fd == -1)
+        return nullptr;
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    *size = (size_t)st.st_size;
+    return data;
+}
+
+void util_unmapfile(void *data, size_t size) {
+    munmap(data, size);
+}
 #else
 bool util_isatty(FILE *file) {
     return false;
 }
+
+void *util_mapfile(const char *filename, size_t *size) {
+    (void)filename;
+    (void)size;
+    return nullptr;
+}
+
+void util_unmapfile(void *data, size_t size) {
+    (void)data;
+    (void)size;
+}
 #endif
 
 /*